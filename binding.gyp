@@ -6,7 +6,11 @@
     ],
     "conditions": [
       ['OS=="mac"', {
-        'sources' : [ "src/macadam.cc", "src/Capture.cc", "src/Playback.cc" ],
+        'sources' : [ "src/macadam.cc", "src/Capture.cc", "src/Playback.cc",
+          "src/FramePool.cc", "src/Recorder.cc", "src/BufferFrame.cc",
+          "src/SequenceSource.cc", "src/Convert.cc", "src/FrameGeometry.cc",
+          "src/ModeCatalogue.cc", "src/DeviceRegistry.cc",
+          "src/DeviceInfo.cc", "src/DeviceStatus.cc" ],
         'xcode_settings': {
           'GCC_ENABLE_CPP_RTTI': 'YES',
           'MACOSX_DEPLOYMENT_TARGET': '10.7',
@@ -25,7 +29,11 @@
         ]
       }],
       ['OS=="linux"', {
-        'sources' : [ "src/macadam.cc", "src/Capture.cc", "src/Playback.cc" ],
+        'sources' : [ "src/macadam.cc", "src/Capture.cc", "src/Playback.cc",
+          "src/FramePool.cc", "src/Recorder.cc", "src/BufferFrame.cc",
+          "src/SequenceSource.cc", "src/Convert.cc", "src/FrameGeometry.cc",
+          "src/ModeCatalogue.cc", "src/DeviceRegistry.cc",
+          "src/DeviceInfo.cc", "src/DeviceStatus.cc" ],
         'link_settings' : {
           "libraries": [
             "/usr/lib/libDeckLinkAPI.so"
@@ -40,6 +48,10 @@
       }],
       ['OS=="win"', {
         "sources" : [ "src/macadam.cc", "src/Capture.cc", "src/Playback.cc",
+          "src/FramePool.cc", "src/Recorder.cc", "src/BufferFrame.cc",
+          "src/SequenceSource.cc", "src/Convert.cc", "src/FrameGeometry.cc",
+          "src/ModeCatalogue.cc", "src/DeviceRegistry.cc",
+          "src/DeviceInfo.cc", "src/DeviceStatus.cc",
           "decklink/Win/include/DeckLinkAPI_i.c" ],
         "configurations": {
           "Release": {
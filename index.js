@@ -50,6 +50,8 @@ var bindings = require('bindings');
 var macadamNative = bindings('macadam');
 const util = require('util');
 const EventEmitter = require('events');
+const fs = require('fs');
+const path = require('path');
 
 // var SegfaultHandler = require('../node-segfault-handler');
 // SegfaultHandler.registerHandler("crash.log");
@@ -77,9 +79,15 @@ Capture.prototype.start = function () {
         return 'Cannot start capture when no device is present.';
       }
     }
-    this.capture.doCapture((v, a) => {
-      this.emit('frame', v, a);
+    var result = this.capture.doCapture((v, a, t) => {
+      if (Array.isArray(v))
+        this.emit('frames', v);
+      else
+        this.emit('frame', v, a, t);
     });
+    if (result !== 'Capture started.')
+      this.emit('error', new Error(result));
+    return result;
   } catch (err) {
     this.emit('error', err);
   }
@@ -112,6 +120,127 @@ Capture.prototype.enableAudio = function (sampleRate, sampleType, channelCount)
   }
 }
 
+Capture.prototype.enableZeroCopy = function (enable) {
+  try {
+    return this.capture.enableZeroCopy(enable !== false);
+  } catch (err) {
+    return "Error when enabling zero copy: " + err;
+  }
+}
+
+// Deliver frames in another pixel format, converted natively from the
+// capture format.
+Capture.prototype.setOutputFormat = function (format) {
+  try {
+    var result = this.capture.setOutputFormat(format);
+    if (result !== 'Output format set.')
+      throw new Error("Problem setting output format: " + result);
+    return result;
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+Capture.prototype.enableFramePool = function (slots, hugePages) {
+  try {
+    return this.capture.enableFramePool(
+      typeof slots === 'number' ? slots : 0, hugePages === true);
+  } catch (err) {
+    return "Error when enabling frame pool: " + err;
+  }
+}
+
+Capture.prototype.enableBatching = function (maxFrames) {
+  try {
+    return this.capture.enableBatching(typeof maxFrames === 'number' ? maxFrames : 0);
+  } catch (err) {
+    return "Error when enabling batching: " + err;
+  }
+}
+
+// Follow changes in the format of the incoming signal, restarting the input
+// in the new display mode and emitting a 'formatChanged' event.
+Capture.prototype.enableFormatDetection = function (enable) {
+  try {
+    return this.capture.enableFormatDetection(enable !== false, (err, format) => {
+      if (err) this.emit('error', err);
+      else this.emit('formatChanged', format);
+    });
+  } catch (err) {
+    return "Error when enabling format detection: " + err;
+  }
+}
+
+// Record frames to disk natively, without passing them to Javascript.
+// Options are:
+//   sequence: write a file per frame, with path a pattern such as 'cap_%08d.v210'
+//   maxFrames: number of frames to record, preallocated for a single file
+//   direct: bypass the operating system cache where supported
+Capture.prototype.record = function (path, options) {
+  options = options || {};
+  try {
+    var result = this.capture.startRecording(path, options.sequence === true,
+      typeof options.maxFrames === 'number' ? options.maxFrames : 0,
+      options.direct === true, (err, progress) => {
+        if (err) this.emit('error', err);
+        else this.emit('recordProgress', progress);
+      });
+    if (result !== 'Recording started.')
+      throw new Error("Problem starting recording: " + result);
+    return result;
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+Capture.prototype.stopRecording = function () {
+  try {
+    return this.capture.stopRecording();
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+// Pass captured frames and audio natively to a playback, without them
+// reaching Javascript. Playback starts once delay frames are queued, unless
+// it is already running. Link before starting the capture. Options are:
+//   sync: drop or repeat frames to hold the delay when the capture is not
+//         locked to the playback's reference
+Capture.prototype.link = function (playback, delay, options) {
+  options = options || {};
+  try {
+    if (!this.initialised) {
+      this.initialised = this.capture.init() ? true : false;
+      if (!this.initialised)
+        throw new Error('Cannot link a capture when no device is present.');
+    }
+    if (!playback.initialised) {
+      playback.initialised = playback.playback.init() ? true : false;
+      if (!playback.initialised)
+        throw new Error('Cannot link to a playback when no device is present.');
+    }
+    var result = this.capture.link(playback.playback,
+      typeof delay === 'number' ? delay : 3, options.sync === true);
+    if (result !== 'Capture linked.')
+      throw new Error("Problem linking capture: " + result);
+    return result;
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+Capture.prototype.unlink = function () {
+  try {
+    return this.capture.unlink();
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+Capture.prototype.getStats = function () {
+  return this.capture.getStats();
+}
+
 function Playback (deviceIndex, displayMode, pixelFormat) {
   if (arguments.length !== 3 || typeof deviceIndex !== 'number' ||
       typeof displayMode !== 'number' || typeof pixelFormat !== 'number' ) {
@@ -132,8 +261,8 @@ Playback.prototype.start = function () {
       console.log("*** playback.init", this.playback.init());
       this.initialised = true;
     }
-    console.log("*** playback.doPlayback", this.playback.doPlayback(function (x) {
-      this.emit('played', x);
+    console.log("*** playback.doPlayback", this.playback.doPlayback(function (x, seq, ts) {
+      this.emit('played', x, seq, ts);
     }.bind(this)));
   } catch (err) {
     this.emit('error', err);
@@ -157,6 +286,76 @@ Playback.prototype.frame = function (f, a) {
   }
 }
 
+// Schedule a run of frames at once, each an object with a video buffer and an
+// optional audio buffer. Returns the total number of frames scheduled.
+Playback.prototype.frames = function (list) {
+  try {
+    if (!this.initialised) {
+      this.playback.init();
+      this.initialised = true;
+    }
+    var result = this.playback.scheduleFrames(list);
+    if (typeof result === 'string')
+      throw new Error("Problem scheduling frames: " + result);
+    else
+      return result;
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+// As frame(), but copies and schedules the frame on a worker thread, in the
+// order frames are sent. Returns a promise for the number of frames scheduled.
+Playback.prototype.frameAsync = function (f, a) {
+  try {
+    if (!this.initialised) {
+      this.playback.init();
+      this.initialised = true;
+    }
+    return a ? this.playback.scheduleFrameAsync(f, a) : this.playback.scheduleFrameAsync(f);
+  } catch (err) {
+    return Promise.reject(err);
+  }
+}
+
+// Play a sequence of files, one frame per file, read ahead natively. Files is
+// either a list of paths or a directory, played in name order. Options are:
+//   lookahead: number of frames to read ahead, default 8
+//   threads: number of reading threads, default 2
+//   loop: start again after the last file
+//   depth: frames to keep queued on the card, as for enableScheduler
+//   extension: only play files in a directory with this extension
+// Emits 'sequenceEnd' when the last frame is queued for playback.
+Playback.prototype.playSequence = function (files, options) {
+  options = options || {};
+  try {
+    if (!this.initialised) {
+      this.playback.init();
+      this.initialised = true;
+    }
+    if (typeof files === 'string') {
+      var dir = files;
+      files = fs.readdirSync(dir)
+        .filter(x => !options.extension || x.endsWith(options.extension))
+        .sort()
+        .map(x => path.join(dir, x))
+        .filter(x => fs.statSync(x).isFile());
+    }
+    var result = this.playback.playSequence(files,
+      typeof options.lookahead === 'number' ? options.lookahead : 8,
+      typeof options.threads === 'number' ? options.threads : 2,
+      options.loop === true,
+      typeof options.depth === 'number' ? options.depth : 0, () => {
+        this.emit('sequenceEnd');
+      });
+    if (result !== 'Sequence started.')
+      throw new Error("Problem playing sequence: " + result);
+    return result;
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
 Playback.prototype.stop = function () {
   try {
     console.log('*** playback stop', this.playback.stop());
@@ -166,7 +365,10 @@ Playback.prototype.stop = function () {
   }
 }
 
-Playback.prototype.enableAudio = function (sampleRate, sampleType, channelCount) {
+// With bufferSamples set, audio plays continuously from a native buffer of
+// that many sample frames, filled with writeAudio. An 'audioNeeded' event is
+// emitted with the free space, in sample frames, when the buffer runs low.
+Playback.prototype.enableAudio = function (sampleRate, sampleType, channelCount, bufferSamples) {
   try {
     if (!this.initialised) {
       this.initialised = this.playback.init() ? true : false;
@@ -178,12 +380,73 @@ Playback.prototype.enableAudio = function (sampleRate, sampleType, channelCount)
     return this.playback.enableAudio(
       typeof sampleRate === 'string' ? +sampleRate : sampleRate,
       typeof sampleType === 'string' ? +sampleType: sampleType,
-      typeof channelCount === 'string' ? +channelCount : channelCount);
+      typeof channelCount === 'string' ? +channelCount : channelCount,
+      typeof bufferSamples === 'string' ? +bufferSamples : bufferSamples,
+      (space) => {
+        this.emit('audioNeeded', space);
+      });
   } catch (err) {
     return "Error when enabling audio: " + err;
   }
 }
 
+// Add audio to the native buffer, returning the number of sample frames that
+// fitted.
+Playback.prototype.writeAudio = function (a) {
+  try {
+    var result = this.playback.writeAudio(a);
+    if (typeof result === 'string')
+      throw new Error("Problem writing audio: " + result);
+    else
+      return result;
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+// Keep depth frames queued on the card natively, filling in when Javascript
+// falls behind by repeating the last frame ('repeat', the default) or playing
+// black ('black'). Each underrun is reported with an 'underrun' event.
+Playback.prototype.enableScheduler = function (depth, mode) {
+  try {
+    var result = this.playback.enableScheduler(typeof depth === 'number' ? depth : 0,
+      mode !== 'black', (underrun) => {
+        this.emit('underrun', underrun);
+      });
+    if (result !== 'scheduler enabled')
+      throw new Error("Problem enabling scheduler: " + result);
+    return result;
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+Playback.prototype.enableZeroCopy = function (enable) {
+  try {
+    return this.playback.enableZeroCopy(enable !== false);
+  } catch (err) {
+    return "Error when enabling zero copy: " + err;
+  }
+}
+
+// Set the pixel format of frames passed to frame, frameAsync, frames and
+// playSequence, converted natively to the playback format as each frame is
+// copied to the card. Zero copy is not used while converting.
+Playback.prototype.setInputFormat = function (format) {
+  try {
+    var result = this.playback.setInputFormat(format);
+    if (result !== 'Input format set.')
+      throw new Error("Problem setting input format: " + result);
+    return result;
+  } catch (err) {
+    this.emit('error', err);
+  }
+}
+
+Playback.prototype.getStats = function () {
+  return this.playback.getStats();
+}
+
 Playback.prototype.testStuff = function () {
   this.playback.testStuff();
 }
@@ -197,7 +460,67 @@ function intToBMCode(i) {
   return b.toString();
 }
 
+// Display modes of every device, by mode, as read natively when the module
+// loaded. Modes that no device has fall back to the tables below.
+var nativeModes = null;
+
+function nativeMode (mode) {
+  if (nativeModes === null) {
+    nativeModes = {};
+    for ( var x = 0 ; ; x++ ) {
+      var modes = macadamNative.getDisplayModes(x);
+      if (modes === undefined) break;
+      modes.forEach(function (m) {
+        if (!nativeModes[m.mode]) nativeModes[m.mode] = m;
+      });
+    }
+  }
+  return nativeModes[mode];
+}
+
+// Emits 'arrived' and 'removed' with the device index as devices are plugged
+// in and removed. Indices stay the same while the process runs, so a device
+// that returns can be opened again at the index it had.
+var deviceEvents = new EventEmitter();
+
+var deviceError = macadamNative.setDeviceCallback(function (change, deviceIndex) {
+  if (change === 'arrived') nativeModes = null; // Pick up the device's modes
+  deviceEvents.emit(change, deviceIndex);
+});
+if (deviceError) {
+  // Reported once the module's user has had the chance to listen
+  process.nextTick(function () {
+    var err = new Error(deviceError);
+    if (deviceEvents.listenerCount('error') > 0) deviceEvents.emit('error', err);
+    else console.error('Cannot report device changes:', err.message);
+  });
+}
+
+// Devices are only watched for status changes once something listens, then
+// 'status' is emitted with the device index, item name and new value
+deviceEvents.on('newListener', function watchStatus (event) {
+  if (event !== 'status') return;
+  deviceEvents.removeListener('newListener', watchStatus);
+  macadamNative.setStatusCallback(function (err, changes) {
+    if (err) {
+      // An 'error' event with no listener would throw from the callback
+      if (deviceEvents.listenerCount('error') > 0) deviceEvents.emit('error', err);
+      else console.error('Cannot watch status of device', err.deviceIndex + ':', err.message);
+      return;
+    }
+    changes.forEach(function (c) {
+      deviceEvents.emit('status', c.deviceIndex, c.name, c.value);
+    });
+  });
+});
+
+function getDisplayModes (deviceIndex) {
+  return macadamNative.getDisplayModes(deviceIndex);
+}
+
 function modeWidth (mode) {
+  var native = nativeMode(mode);
+  if (native) return native.width;
   switch (mode) {
     case macadam.bmdModeNTSC:
     case macadam.bmdModeNTSC2398:
@@ -247,6 +570,8 @@ function modeWidth (mode) {
 }
 
 function modeHeight (mode) {
+  var native = nativeMode(mode);
+  if (native) return native.height;
   switch (mode) {
     case macadam.bmdModeNTSC:
     case macadam.bmdModeNTSC2398:
@@ -299,6 +624,8 @@ function modeHeight (mode) {
 // Returns the duration of a frame as fraction of a second as an array:
 //   [<enumverator>, [denominotor>]
 function modeGrainDuration (mode) {
+  var native = nativeMode(mode);
+  if (native) return [native.frameDuration, native.timeScale];
   switch (mode) {
     case macadam.bmdModeNTSC:
       return [1001, 30000];
@@ -378,6 +705,9 @@ function modeGrainDuration (mode) {
 };
 
 function modeInterlace (mode) {
+  var native = nativeMode(mode);
+  if (native) return native.fieldDominance === macadam.bmdLowerFieldFirst ||
+    native.fieldDominance === macadam.bmdUpperFieldFirst;
   switch (mode) {
     case macadam.bmdModeNTSC:
     case macadam.bmdModeNTSC2398:
@@ -448,6 +778,19 @@ function formatDepth (format) {
   };
 };
 
+// Convert a frame between pixel formats, from src into dst. Omit dst to
+// convert in place. Give the frame width to convert rows padded as the card
+// pads them or packed with no padding, otherwise src is converted as one
+// long row. Returns the number of bytes of dst written.
+function convert (src, srcFormat, dst, dstFormat, width) {
+  if (typeof dst === 'number') {
+    width = dstFormat;
+    dstFormat = dst;
+    dst = src;
+  }
+  return macadamNative.convert(src, srcFormat, dst, dstFormat, width);
+};
+
 function formatFourCC (format) {
   switch (format) {
     case macadam.bmdFormat8BitYUV:
@@ -618,6 +961,15 @@ var macadam = {
   bmdUpperFieldFirst              : bmCodeToInt('uppr'),
   bmdProgressiveFrame             : bmCodeToInt('prog'),
   bmdProgressiveSegmentedFrame    : bmCodeToInt('psf '),
+  /* Enum BMDOutputFrameCompletionResult - Frame Completion Callback */
+  bmdOutputFrameCompleted         : 0,
+  bmdOutputFrameDisplayedLate     : 1,
+  bmdOutputFrameDropped           : 2,
+  bmdOutputFrameFlushed           : 3,
+  /* Enum BMDDetectedVideoInputFormatFlags - Flags describing the detected input signal */
+  bmdDetectedVideoInputYCbCr422   : 1 << 0,
+  bmdDetectedVideoInputRGB444     : 1 << 1,
+  bmdDetectedVideoInputDualStream3D : 1 << 2,
   /* Enum BMDPixelFormat - Video pixel formats supported for output/input */
   bmdFormat8BitYUV                : bmCodeToInt('2vuy'),
   bmdFormat10BitYUV               : bmCodeToInt('v210'),
@@ -633,6 +985,9 @@ var macadam = {
   bmdFormat10BitRGBXLE            : bmCodeToInt('R10l'),
   // Big-endian 10-bit RGB with SMPTE video levels (64-940)
   bmdFormat10BitRGBX              : bmCodeToInt('R10b'),
+  // EBU test material .yuv10 - 4:2:2 10-bit, three samples in the top 30 bits
+  // of each big-endian word. Not played by the card, but can be converted.
+  formatYUV10                     : bmCodeToInt('yu10'),
   /* Enum BMDDisplayModeFlags - Flags to describe the characteristics of an IDeckLinkDisplayMode. */
   bmdDisplayModeSupports3D        : 1 << 0,
   bmdDisplayModeColorspaceRec601  : 1 << 1,
@@ -644,6 +999,7 @@ var macadam = {
   intToBMCode : intToBMCode,
   bmCodeToInt : bmCodeToInt,
   // Get parameters from modes and formats
+  getDisplayModes : getDisplayModes,
   modeWidth : modeWidth,
   modeHeight : modeHeight,
   modeGrainDuration : modeGrainDuration,
@@ -653,9 +1009,17 @@ var macadam = {
   fourCCFormat : fourCCFormat,
   formatSampling : formatSampling,
   formatColorimetry : formatColorimetry,
+  // Convert frames between pixel formats, with the instruction set used
+  convert : convert,
+  convertKernel : macadamNative.convertKernel,
+  // Row and frame bytes for a pixel format and frame size
+  frameGeometry : macadamNative.frameGeometry,
   // access details about the currently connected devices
   deckLinkVersion : macadamNative.deckLinkVersion,
   getFirstDevice : macadamNative.getFirstDevice,
+  getDevices : macadamNative.getDevices,
+  getStatus : macadamNative.getStatus,
+  deviceEvents : deviceEvents,
   // Raw access to device classes
   DirectCapture : macadamNative.Capture,
   Capture : Capture,
@@ -0,0 +1,93 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef AUDIORING_H
+#define AUDIORING_H
+
+#include <atomic>
+#include <vector>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace streampunk {
+
+// Bounded lock-free byte queue for exactly one producer thread and one
+// consumer thread, for streaming audio samples. The producer copies in
+// chunks of any size; the consumer reads in place from contiguous regions.
+// Wrapping happens only at the capacity, so when the capacity and every
+// write and read are whole sample frames, regions hold whole sample frames.
+class AudioRing
+{
+public:
+  explicit AudioRing(size_t capacity) :
+    capacity_(capacity), data_(capacity), head_(0), tail_(0) {}
+
+  // Producer only. Copies as many bytes as fit, returning the number copied.
+  size_t write(const char* data, size_t bytes) {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    size_t space = capacity_ - (size_t) (tail - head);
+    if (bytes > space) bytes = space;
+    size_t offset = (size_t) (tail % capacity_);
+    size_t first = capacity_ - offset;
+    if (first > bytes) first = bytes;
+    memcpy(&data_[offset], data, first);
+    memcpy(&data_[0], data + first, bytes - first);
+    tail_.store(tail + bytes, std::memory_order_release);
+    return bytes;
+  }
+
+  // Consumer only. Points data at the oldest bytes, returning how many can
+  // be read there without wrapping.
+  size_t peek(const char** data) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    size_t offset = (size_t) (head % capacity_);
+    size_t bytes = (size_t) (tail - head);
+    if (bytes > capacity_ - offset) bytes = capacity_ - offset;
+    *data = &data_[offset];
+    return bytes;
+  }
+
+  // Consumer only. Discards bytes that have been read.
+  void consume(size_t bytes) {
+    head_.store(head_.load(std::memory_order_relaxed) + bytes, std::memory_order_release);
+  }
+
+  // Snapshot of the number of queued bytes; exact only on the producer or
+  // consumer thread.
+  size_t size() const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    return (size_t) (tail - head);
+  }
+
+  size_t capacity() const { return capacity_; }
+
+private:
+  const size_t capacity_;
+  std::vector<char> data_;
+  // Running totals of bytes read and written. Keep the consumer and
+  // producer counts on separate cache lines.
+  char padHead_[64];
+  std::atomic<uint64_t> head_;
+  char padTail_[64];
+  std::atomic<uint64_t> tail_;
+};
+
+} // namespace streampunk
+
+#endif
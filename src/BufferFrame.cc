@@ -0,0 +1,115 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "BufferFrame.h"
+#include <stdint.h>
+
+namespace streampunk {
+
+FrameReclaimer::FrameReclaimer() : outstanding_(0), released_(false) {
+  async = new uv_async_t;
+  uv_async_init(uv_default_loop(), async, ReclaimCallback);
+  uv_mutex_init(&padlock);
+  async->data = this;
+}
+
+void FrameReclaimer::reclaim(BufferFrame* frame) {
+  uv_mutex_lock(&padlock);
+  frames_.push_back(frame);
+  uv_mutex_unlock(&padlock);
+  uv_async_send(async);
+}
+
+void FrameReclaimer::drain() {
+  std::vector<BufferFrame*> frames;
+  uv_mutex_lock(&padlock);
+  frames.swap(frames_);
+  uv_mutex_unlock(&padlock);
+  for ( auto frame : frames )
+    delete frame;
+  outstanding_ -= (uint32_t) frames.size();
+}
+
+void FrameReclaimer::release() {
+  released_ = true;
+  drain();
+  closeIfDone();
+}
+
+void FrameReclaimer::closeIfDone() {
+  if (released_ && (outstanding_ == 0))
+    uv_close((uv_handle_t*) async, CloseCallback);
+}
+
+FrameReclaimer::~FrameReclaimer() {
+  uv_mutex_destroy(&padlock);
+}
+
+void FrameReclaimer::CloseCallback(uv_handle_t* handle) {
+  FrameReclaimer* reclaimer = static_cast<FrameReclaimer*>(handle->data);
+  delete (uv_async_t*) handle;
+  delete reclaimer;
+}
+
+NAUV_WORK_CB(FrameReclaimer::ReclaimCallback) {
+  Nan::HandleScope scope;
+  FrameReclaimer* reclaimer = static_cast<FrameReclaimer*>(async->data);
+  reclaimer->drain();
+  reclaimer->closeIfDone();
+}
+
+BufferFrame::BufferFrame(v8::Local<v8::Object> buffer, long width, long height,
+    long rowBytes, BMDPixelFormat pixelFormat, FrameReclaimer* reclaimer) :
+    refCount_(1), buffer_(buffer), data_(node::Buffer::Data(buffer)),
+    width_(width), height_(height), rowBytes_(rowBytes),
+    pixelFormat_(pixelFormat), reclaimer_(reclaimer) {
+  reclaimer_->outstanding_++;
+}
+
+BufferFrame::~BufferFrame() {
+  buffer_.Reset();
+}
+
+bool BufferFrame::canWrap(const char* data) {
+  return ((uintptr_t) data % BUFFER_FRAME_ALIGNMENT) == 0;
+}
+
+ULONG BufferFrame::AddRef() {
+  return ++refCount_;
+}
+
+ULONG BufferFrame::Release() {
+  ULONG count = --refCount_;
+  if (count == 0) // Usually on the output callback thread
+    reclaimer_->reclaim(this);
+  return count;
+}
+
+HRESULT BufferFrame::GetBytes(void **buffer) {
+  *buffer = data_;
+  return S_OK;
+}
+
+HRESULT BufferFrame::GetTimecode(BMDTimecodeFormat format, IDeckLinkTimecode **timecode) {
+  *timecode = NULL;
+  return S_FALSE;
+}
+
+HRESULT BufferFrame::GetAncillaryData(IDeckLinkVideoFrameAncillary **ancillary) {
+  *ancillary = NULL;
+  return S_FALSE;
+}
+
+} // namespace streampunk
@@ -0,0 +1,112 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef BUFFERFRAME_H
+#define BUFFERFRAME_H
+
+#include <uv.h>
+#include <nan.h>
+#include <atomic>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+// Alignment of buffer memory that the card can read from directly
+#define BUFFER_FRAME_ALIGNMENT 16
+
+namespace streampunk {
+
+class BufferFrame;
+
+// Collects buffer frames released on driver threads and deletes them on the
+// event loop thread, where their persistent buffer handles can be reset.
+// Frames may outlive their playback on the card, so the reclaimer is freed
+// by release() once its owner has finished with it and no frames remain.
+class FrameReclaimer
+{
+public:
+  FrameReclaimer();
+
+  // Any thread
+  void reclaim(BufferFrame* frame);
+  // Event loop thread. Deletes frames reclaimed so far.
+  void drain();
+  // Event loop thread. Drop the owner's use of the reclaimer, closing its
+  // handle and deleting it once every frame has been reclaimed.
+  void release();
+
+private:
+  friend class BufferFrame;
+  ~FrameReclaimer();
+
+  static NAUV_WORK_CB(ReclaimCallback);
+  static void CloseCallback(uv_handle_t* handle);
+  // close and delete if released with no frames outstanding
+  void closeIfDone();
+
+  uv_async_t *async;
+  uv_mutex_t padlock;
+  std::vector<BufferFrame*> frames_;
+  // Frames made and not yet deleted, counted on the event loop thread
+  uint32_t outstanding_;
+  bool released_;
+};
+
+// Video frame for playback that points straight at the memory of a JS buffer
+// rather than a copy of it. The buffer is held by a persistent handle until
+// the last reference to the frame is released, normally once the card has
+// played it.
+class BufferFrame : public IDeckLinkVideoFrame
+{
+public:
+  // Event loop thread only. Takes the initial reference.
+  BufferFrame(v8::Local<v8::Object> buffer, long width, long height,
+    long rowBytes, BMDPixelFormat pixelFormat, FrameReclaimer* reclaimer);
+
+  // Whether the card can read a frame straight from this buffer memory
+  static bool canWrap(const char* data);
+
+  // IDeckLinkVideoFrame
+  virtual long GetWidth () { return width_; }
+  virtual long GetHeight () { return height_; }
+  virtual long GetRowBytes () { return rowBytes_; }
+  virtual BMDPixelFormat GetPixelFormat () { return pixelFormat_; }
+  virtual BMDFrameFlags GetFlags () { return bmdFrameFlagDefault; }
+  virtual HRESULT GetBytes (void **buffer);
+  virtual HRESULT GetTimecode (BMDTimecodeFormat format, IDeckLinkTimecode **timecode);
+  virtual HRESULT GetAncillaryData (IDeckLinkVideoFrameAncillary **ancillary);
+
+  // IUnknown
+  HRESULT QueryInterface (REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+  ULONG AddRef ();
+  ULONG Release ();
+
+private:
+  friend class FrameReclaimer;
+  virtual ~BufferFrame();
+
+  std::atomic<ULONG> refCount_;
+  Nan::Persistent<v8::Object> buffer_;
+  char* data_;
+  long width_;
+  long height_;
+  long rowBytes_;
+  BMDPixelFormat pixelFormat_;
+  FrameReclaimer* reclaimer_;
+};
+
+} // namespace streampunk
+
+#endif
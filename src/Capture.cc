@@ -41,6 +41,10 @@
  */
 
 #include "Capture.h"
+#include "Convert.h"
+#include "FrameGeometry.h"
+#include "ModeCatalogue.h"
+#include "DeviceRegistry.h"
 
 namespace streampunk {
 
@@ -50,17 +54,74 @@ inline Nan::Persistent<v8::Function> &Capture::constructor() {
 }
 
 Capture::Capture(uint32_t deviceIndex, uint32_t displayMode,
-    uint32_t pixelFormat) : deviceIndex_(deviceIndex),
-    displayMode_(displayMode), pixelFormat_(pixelFormat), latestFrame_(NULL) {
+    uint32_t pixelFormat) : m_deckLink(NULL), m_deckLinkInput(NULL), deviceIndex_(deviceIndex),
+    displayMode_(displayMode), pixelFormat_(pixelFormat), sampleByteFactor_(0),
+    zeroCopy_(false),
+    outputFormat_(pixelFormat),
+    poolEnabled_(false), poolHugePages_(false), poolSlots_(0), framePool_(NULL),
+    batching_(false), batchSize_(0), recorder_(NULL), recording_(false),
+    link_(NULL), linked_(false),
+    formatDetection_(false), formatPending_(false), formatError_(NULL),
+    frameQueue_(CAPTURE_QUEUE_DEPTH) {
   async = new uv_async_t;
   uv_async_init(uv_default_loop(), async, FrameCallback);
   uv_mutex_init(&padlock);
   async->data = this;
+  recordAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), recordAsync, RecordCallback);
+  recordAsync->data = this;
+  formatAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), formatAsync, FormatCallback);
+  formatAsync->data = this;
+}
+
+// Close callback for handles owned by a capture, freed once libuv is done
+static void freeAsync(uv_handle_t* handle) {
+  delete (uv_async_t*) handle;
 }
 
 Capture::~Capture() {
+  // Stop input and clear its callback, so that the card thread cannot reach
+  // this object or send to its handles once they are closed
+  if (m_deckLinkInput != NULL) {
+    m_deckLinkInput->StopStreams();
+    m_deckLinkInput->DisableVideoInput();
+    m_deckLinkInput->SetCallback(NULL);
+  }
+  uv_close((uv_handle_t*) formatAsync, freeAsync);
+  unlinkPlayback();
+  if (recorder_ != NULL) {
+    recorder_->stop();
+    delete recorder_;
+  }
+  // The recorder's thread has finished, so nothing can send to the handle
+  uv_close((uv_handle_t*) recordAsync, freeAsync);
+  if (!recordCB_.IsEmpty())
+    recordCB_.Reset();
+  if (!formatCB_.IsEmpty())
+    formatCB_.Reset();
+  drainFrameQueue();
   if (!captureCB_.IsEmpty())
     captureCB_.Reset();
+  releaseDeckLink();
+}
+
+void Capture::releaseDeckLink() {
+  if (m_deckLinkInput != NULL) {
+    m_deckLinkInput->Release();
+    m_deckLinkInput = NULL;
+  }
+  if (m_deckLink != NULL) {
+    m_deckLink->Release();
+    m_deckLink = NULL;
+  }
+}
+
+uint32_t Capture::currentMode() {
+  uv_mutex_lock(&padlock);
+  uint32_t mode = displayMode_;
+  uv_mutex_unlock(&padlock);
+  return mode;
 }
 
 NAN_MODULE_INIT(Capture::Init) {
@@ -83,6 +144,16 @@ NAN_MODULE_INIT(Capture::Init) {
   Nan::SetPrototypeMethod(tpl, "doCapture", DoCapture);
   Nan::SetPrototypeMethod(tpl, "stop", StopCapture);
   Nan::SetPrototypeMethod(tpl, "enableAudio", EnableAudio);
+  Nan::SetPrototypeMethod(tpl, "enableZeroCopy", EnableZeroCopy);
+  Nan::SetPrototypeMethod(tpl, "enableFramePool", EnableFramePool);
+  Nan::SetPrototypeMethod(tpl, "setOutputFormat", SetOutputFormat);
+  Nan::SetPrototypeMethod(tpl, "getStats", GetStats);
+  Nan::SetPrototypeMethod(tpl, "enableBatching", EnableBatching);
+  Nan::SetPrototypeMethod(tpl, "startRecording", StartRecording);
+  Nan::SetPrototypeMethod(tpl, "stopRecording", StopRecording);
+  Nan::SetPrototypeMethod(tpl, "link", Link);
+  Nan::SetPrototypeMethod(tpl, "unlink", Unlink);
+  Nan::SetPrototypeMethod(tpl, "enableFormatDetection", EnableFormatDetection);
 
   constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
   Nan::Set(target, Nan::New("Capture").ToLocalChecked(),
@@ -109,34 +180,26 @@ NAN_METHOD(Capture::New) {
 }
 
 NAN_METHOD(Capture::BMInit) {
-  IDeckLinkIterator* deckLinkIterator;
-  HRESULT	result;
-  IDeckLinkAPIInformation *deckLinkAPIInformation;
-  IDeckLink* deckLink;
-  #ifdef WIN32
-  CoCreateInstance(CLSID_CDeckLinkIterator, NULL, CLSCTX_ALL, IID_IDeckLinkIterator, (void**)&deckLinkIterator);
-  #else
-  deckLinkIterator = CreateDeckLinkIteratorInstance();
-  #endif
-  result = deckLinkIterator->QueryInterface(IID_IDeckLinkAPIInformation, (void**)&deckLinkAPIInformation);
-  if (result != S_OK) {
+  DeviceRegistry* registry = DeviceRegistry::get();
+  if (registry == NULL) {
     Nan::ThrowError("Error connecting to DeckLinkAPI.");
+    return;
   }
   Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
 
-  for ( uint32_t x = 0 ; x <= obj->deviceIndex_ ; x++ ) {
-    if (deckLinkIterator->Next(&deckLink) != S_OK) {
-      info.GetReturnValue().Set(Nan::Undefined());
-      return;
-    }
+  IDeckLink* deckLink = registry->acquire(obj->deviceIndex_);
+  if (deckLink == NULL) {
+    info.GetReturnValue().Set(Nan::Undefined());
+    return;
   }
-
+  obj->releaseDeckLink();
   obj->m_deckLink = deckLink;
 
   IDeckLinkInput *deckLinkInput;
   if (deckLink->QueryInterface(IID_IDeckLinkInput, (void **)&deckLinkInput) != S_OK)
 	{
     Nan::ThrowError("Could not obtain the DeckLink Input interface.");
+    return;
 	}
   obj->m_deckLinkInput = deckLinkInput;
   if (deckLinkInput)
@@ -170,14 +233,250 @@ NAN_METHOD(Capture::EnableAudio) {
   }
 }
 
+NAN_METHOD(Capture::EnableZeroCopy) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  obj->zeroCopy_ = info[0]->IsUndefined() ? true : Nan::To<bool>(info[0]).FromJust();
+
+  info.GetReturnValue().Set(Nan::New<v8::String>(obj->zeroCopy_ ?
+    "zero copy enabled" : "zero copy disabled").ToLocalChecked());
+}
+
+NAN_METHOD(Capture::EnableFramePool) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  obj->poolSlots_ = info[0]->IsNumber() ? Nan::To<uint32_t>(info[0]).FromJust() : 0;
+  obj->poolHugePages_ = info[1]->IsUndefined() ? false : Nan::To<bool>(info[1]).FromJust();
+  obj->poolEnabled_ = true;
+
+  info.GetReturnValue().Set(Nan::New<v8::String>("frame pool enabled").ToLocalChecked());
+}
+
+NAN_METHOD(Capture::SetOutputFormat) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  uint32_t format = info[0]->IsNumber() ? Nan::To<uint32_t>(info[0]).FromJust() : obj->pixelFormat_;
+  if (!canConvert(obj->pixelFormat_, format)) {
+    info.GetReturnValue().Set(Nan::New("Cannot convert from the capture format to that format.").ToLocalChecked());
+    return;
+  }
+  obj->outputFormat_ = format;
+  info.GetReturnValue().Set(Nan::New("Output format set.").ToLocalChecked());
+}
+
+NAN_METHOD(Capture::EnableBatching) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  obj->batchSize_ = info[0]->IsNumber() ? Nan::To<uint32_t>(info[0]).FromJust() : 0;
+  obj->batching_ = true;
+
+  info.GetReturnValue().Set(Nan::New<v8::String>("batching enabled").ToLocalChecked());
+}
+
+NAN_METHOD(Capture::EnableFormatDetection) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  if (!info[1]->IsFunction()) {
+    Nan::ThrowTypeError("Format detection requires a callback.");
+    return;
+  }
+  obj->formatDetection_ = info[0]->IsUndefined() ? true : Nan::To<bool>(info[0]).FromJust();
+  obj->formatCB_.Reset(v8::Local<v8::Function>::Cast(info[1]));
+
+  info.GetReturnValue().Set(Nan::New<v8::String>(obj->formatDetection_ ?
+    "format detection enabled" : "format detection disabled").ToLocalChecked());
+}
+
+NAN_METHOD(Capture::StartRecording) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  if (!info[0]->IsString() || !info[4]->IsFunction()) {
+    Nan::ThrowTypeError("Recording requires a path and a callback.");
+    return;
+  }
+  std::string path = *Nan::Utf8String(info[0]);
+  bool sequence = Nan::To<bool>(info[1]).FromJust();
+  uint32_t maxFrames = info[2]->IsNumber() ? Nan::To<uint32_t>(info[2]).FromJust() : 0;
+  bool direct = Nan::To<bool>(info[3]).FromJust();
+
+  if (obj->recorder_ != NULL) {
+    info.GetReturnValue().Set(Nan::New("Already recording.").ToLocalChecked());
+    return;
+  }
+  if (obj->link_ != NULL) {
+    info.GetReturnValue().Set(Nan::New("Cannot record while linked to a playback.").ToLocalChecked());
+    return;
+  }
+  if (sequence && !Recorder::validPattern(path)) {
+    info.GetReturnValue().Set(Nan::New(
+      "Sequence path must contain one frame number pattern, e.g. %08d.").ToLocalChecked());
+    return;
+  }
+
+  Recorder* recorder = new Recorder(path, sequence, maxFrames, direct, obj->recordAsync);
+  if (!recorder->start()) {
+    std::string error = recorder->error();
+    delete recorder;
+    info.GetReturnValue().Set(Nan::New(error).ToLocalChecked());
+    return;
+  }
+  obj->recordCB_.Reset(v8::Local<v8::Function>::Cast(info[4]));
+  uv_mutex_lock(&obj->padlock);
+  obj->recorder_ = recorder;
+  obj->recording_ = true;
+  uv_mutex_unlock(&obj->padlock);
+
+  info.GetReturnValue().Set(Nan::New("Recording started.").ToLocalChecked());
+}
+
+NAN_METHOD(Capture::StopRecording) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  info.GetReturnValue().Set(obj->stopRecorder());
+}
+
+v8::Local<v8::Object> Capture::makeRecordStats(Recorder* recorder) {
+  v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+  Nan::Set(stats, Nan::New("framesWritten").ToLocalChecked(),
+    Nan::New<v8::Number>((double) recorder->framesWritten()));
+  Nan::Set(stats, Nan::New("bytesWritten").ToLocalChecked(),
+    Nan::New<v8::Number>((double) recorder->bytesWritten()));
+  Nan::Set(stats, Nan::New("framesDropped").ToLocalChecked(),
+    Nan::New<v8::Number>((double) recorder->framesDropped()));
+  return stats;
+}
+
+v8::Local<v8::Object> Capture::stopRecorder() {
+  uv_mutex_lock(&padlock);
+  Recorder* recorder = recorder_;
+  recorder_ = NULL;
+  recording_ = false;
+  uv_mutex_unlock(&padlock);
+  if (recorder == NULL)
+    return Nan::New<v8::Object>();
+
+  recorder->stop(); // Waits for queued frames to be written
+  v8::Local<v8::Object> stats = makeRecordStats(recorder);
+  std::string error = recorder->error();
+  if (!error.empty())
+    Nan::Set(stats, Nan::New("error").ToLocalChecked(), Nan::New(error).ToLocalChecked());
+  delete recorder;
+  recordCB_.Reset();
+  return stats;
+}
+
+NAN_METHOD(Capture::Link) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  Playback* playback = Playback::fromObject(info[0]);
+  if (playback == NULL) {
+    Nan::ThrowTypeError("Linking requires a playback.");
+    return;
+  }
+  uint32_t delay = info[1]->IsNumber() ? Nan::To<uint32_t>(info[1]).FromJust() : 3;
+  bool sync = Nan::To<bool>(info[2]).FromJust();
+
+  if (obj->link_ != NULL) {
+    info.GetReturnValue().Set(Nan::New("Already linked.").ToLocalChecked());
+    return;
+  }
+  if (obj->recorder_ != NULL) {
+    info.GetReturnValue().Set(Nan::New("Cannot link while recording.").ToLocalChecked());
+    return;
+  }
+  const ModeCatalogue* catalogue = (obj->m_deckLink != NULL) ?
+    ModeCatalogue::forDevice(obj->deviceIndex_, obj->m_deckLink) : NULL;
+  const ModeEntry* entry = (catalogue != NULL) ? catalogue->find(obj->currentMode()) : NULL;
+  if (entry == NULL) {
+    info.GetReturnValue().Set(Nan::New("Capture is not initialised.").ToLocalChecked());
+    return;
+  }
+  const char* error = playback->startLink(obj, delay, sync, entry->frameDuration,
+    entry->timeScale, obj->sampleByteFactor_);
+  if (error != NULL) {
+    info.GetReturnValue().Set(Nan::New(error).ToLocalChecked());
+    return;
+  }
+  obj->linkObj_.Reset(Nan::To<v8::Object>(info[0]).ToLocalChecked());
+  uv_mutex_lock(&obj->padlock);
+  obj->link_ = playback;
+  obj->linked_ = true;
+  uv_mutex_unlock(&obj->padlock);
+
+  info.GetReturnValue().Set(Nan::New("Capture linked.").ToLocalChecked());
+}
+
+NAN_METHOD(Capture::Unlink) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  obj->unlinkPlayback();
+  info.GetReturnValue().Set(Nan::New("Capture unlinked.").ToLocalChecked());
+}
+
+void Capture::unlinkPlayback() {
+  uv_mutex_lock(&padlock);
+  Playback* playback = link_;
+  link_ = NULL;
+  linked_ = false;
+  uv_mutex_unlock(&padlock);
+  if (playback == NULL)
+    return;
+  playback->endLink();
+  linkObj_.Reset();
+}
+
+NAUV_WORK_CB(Capture::RecordCallback) {
+  Nan::HandleScope scope;
+  Capture *capture = static_cast<Capture*>(async->data);
+  if ((capture->recorder_ == NULL) || capture->recordCB_.IsEmpty())
+    return; // Final statistics were returned when recording stopped
+  Nan::Callback cb(Nan::New(capture->recordCB_));
+  std::string error = capture->recorder_->error();
+  v8::Local<v8::Value> err = Nan::Null();
+  if (!error.empty())
+    err = Nan::Error(error.c_str());
+  v8::Local<v8::Value> argv[2] = { err, capture->makeRecordStats(capture->recorder_) };
+  cb.Call(2, argv);
+}
+
+NAN_METHOD(Capture::GetStats) {
+  Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
+  v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+
+  Nan::Set(stats, Nan::New("framesArrived").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesArrived_.get()));
+  Nan::Set(stats, Nan::New("framesDelivered").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesDelivered_.get()));
+  Nan::Set(stats, Nan::New("framesDropped").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesDropped_.get()));
+  Nan::Set(stats, Nan::New("asyncWakeups").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->asyncWakeups_.get()));
+  Nan::Set(stats, Nan::New("asyncMerged").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->asyncMerged_.get()));
+  Nan::Set(stats, Nan::New("queueDepth").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->frameQueue_.size()));
+  Nan::Set(stats, Nan::New("queueHighWater").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->queueHighWater_.get()));
+  Nan::Set(stats, Nan::New("formatChanges").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->formatChanges_.get()));
+  Nan::Set(stats, Nan::New("framesConverted").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesConverted_.get()));
+
+  uint32_t availableFrames = 0;
+  if ((obj->m_deckLinkInput != NULL) &&
+      (obj->m_deckLinkInput->GetAvailableVideoFrameCount(&availableFrames) == S_OK)) {
+    Nan::Set(stats, Nan::New("availableVideoFrames").ToLocalChecked(),
+      Nan::New<v8::Number>(availableFrames));
+  }
+  if (obj->framePool_ != NULL) {
+    Nan::Set(stats, Nan::New("poolSlots").ToLocalChecked(),
+      Nan::New<v8::Number>(obj->framePool_->slotCount()));
+    Nan::Set(stats, Nan::New("poolSlotsInUse").ToLocalChecked(),
+      Nan::New<v8::Number>(obj->framePool_->slotsInUse()));
+  }
+
+  info.GetReturnValue().Set(stats);
+}
+
 NAN_METHOD(Capture::DoCapture) {
   v8::Local<v8::Function> cb = v8::Local<v8::Function>::Cast(info[0]);
   Capture* obj = ObjectWrap::Unwrap<Capture>(info.Holder());
   obj->captureCB_.Reset(cb);
 
-  obj->setupDeckLinkInput();
+  const char* error = obj->setupDeckLinkInput();
 
-  info.GetReturnValue().Set(Nan::New("Capture started.").ToLocalChecked());
+  info.GetReturnValue().Set(Nan::New(error != NULL ? error : "Capture started.").ToLocalChecked());
 }
 
 NAN_METHOD(Capture::StopCapture) {
@@ -201,121 +500,369 @@ HRESULT Capture::setupAudioInput(BMDAudioSampleRate sampleRate,
 void Capture::cleanupDeckLinkInput()
 {
 	m_deckLinkInput->StopStreams();
+	stopRecorder();
+	unlinkPlayback();
 	m_deckLinkInput->DisableVideoInput();
 	m_deckLinkInput->SetCallback(NULL);
+	drainFrameQueue();
+	if (framePool_ != NULL) {
+	  m_deckLinkInput->SetVideoInputFrameMemoryAllocator(NULL);
+	  // Buffers still held by JS keep their own references to the pool
+	  framePool_->Release();
+	  framePool_ = NULL;
+	}
 }
 
-bool Capture::setupDeckLinkInput() {
-  // bool result = false;
-  IDeckLinkDisplayModeIterator*	displayModeIterator = NULL;
-  IDeckLinkDisplayMode*			deckLinkDisplayMode = NULL;
+void Capture::drainFrameQueue() {
+  CaptureEntry entry;
+  while (frameQueue_.pop(entry)) {
+    if (entry.video != NULL) entry.video->Release();
+    if (entry.audio != NULL) entry.audio->Release();
+  }
+}
 
-  m_width = -1;
+const char* Capture::setupDeckLinkInput() {
+  // bool result = false;
+  uint32_t displayMode = currentMode();
 
   // get frame scale and duration for the video mode
-  if (m_deckLinkInput->GetDisplayModeIterator(&displayModeIterator) != S_OK)
-    return false;
-
-  while (displayModeIterator->Next(&deckLinkDisplayMode) == S_OK)
-  {
-    if (deckLinkDisplayMode->GetDisplayMode() == displayMode_)
-    {
-      m_width = deckLinkDisplayMode->GetWidth();
-      m_height = deckLinkDisplayMode->GetHeight();
-      deckLinkDisplayMode->GetFrameRate(&m_frameDuration, &m_timeScale);
-      deckLinkDisplayMode->Release();
+  const ModeCatalogue* catalogue = ModeCatalogue::forDevice(deviceIndex_, m_deckLink);
+  const ModeEntry* entry = (catalogue != NULL) ? catalogue->find(displayMode) : NULL;
+  if (entry == NULL)
+    return "Display mode is not supported by this device.";
+  uv_mutex_lock(&padlock);
+  m_width = entry->width;
+  m_height = entry->height;
+  m_frameDuration = entry->frameDuration;
+  m_timeScale = entry->timeScale;
+  uv_mutex_unlock(&padlock);
 
-      break;
-    }
+  m_deckLinkInput->SetCallback(this);
 
-    deckLinkDisplayMode->Release();
+  if (poolEnabled_ && (framePool_ == NULL)) {
+    // Default to a second's worth of frames; slots are only mapped when used
+    uint32_t slots = poolSlots_;
+    if (slots == 0)
+      slots = (uint32_t) ((m_timeScale + m_frameDuration - 1) / m_frameDuration);
+    if (slots < 8) slots = 8;
+    framePool_ = new FramePool(slots, poolHugePages_);
+    if (m_deckLinkInput->SetVideoInputFrameMemoryAllocator(framePool_) != S_OK) {
+      framePool_->Release();
+      framePool_ = NULL;
+      m_deckLinkInput->SetCallback(NULL);
+      return "Failed to register the capture frame pool.";
+    }
   }
 
-  printf("Width %li Height %li\n", m_width, m_height);
-
-  displayModeIterator->Release();
-
-  if (m_width == -1)
-    return false;
-
-  m_deckLinkInput->SetCallback(this);
+  BMDVideoInputFlags inputFlags = bmdVideoInputFlagDefault;
+  if (formatDetection_) {
+    IDeckLinkAttributes* deckLinkAttributes = NULL;
+    bool supported = false;
+    if (m_deckLink->QueryInterface(IID_IDeckLinkAttributes, (void**)&deckLinkAttributes) == S_OK) {
+      if (deckLinkAttributes->GetFlag(BMDDeckLinkSupportsInputFormatDetection, &supported) != S_OK)
+        supported = false;
+      deckLinkAttributes->Release();
+    }
+    if (supported) {
+      inputFlags |= bmdVideoInputEnableFormatDetection;
+    } else { // Capture carries on in the requested mode
+      uv_mutex_lock(&padlock);
+      formatError_ = "Input format detection is not supported by this device.";
+      uv_mutex_unlock(&padlock);
+      uv_async_send(formatAsync);
+    }
+  }
 
-  if (m_deckLinkInput->EnableVideoInput((BMDDisplayMode) displayMode_, (BMDPixelFormat) pixelFormat_, bmdVideoInputFlagDefault) != S_OK)
-	  return false;
+  if (m_deckLinkInput->EnableVideoInput((BMDDisplayMode) displayMode, (BMDPixelFormat) pixelFormat_, inputFlags) != S_OK)
+	  return "Failed to enable video input.";
 
   if (m_deckLinkInput->StartStreams() != S_OK)
-    return false;
+    return "Failed to start capture streams.";
 
-  return true;
+  return NULL;
 }
 
 HRESULT	Capture::VideoInputFrameArrived (IDeckLinkVideoInputFrame* arrivedFrame, IDeckLinkAudioInputPacket* arrivedAudio)
 {
-  // printf("Arrived video %i audio %i", arrivedFrame == NULL, arrivedAudio == NULL);
-  uv_mutex_lock(&padlock);
-  if (arrivedFrame != NULL) {
-    arrivedFrame->AddRef();
-    latestFrame_ = arrivedFrame;
+  framesArrived_.increment();
+  if (recording_.load(std::memory_order_relaxed)) {
+    uv_mutex_lock(&padlock);
+    if ((recorder_ != NULL) && (arrivedFrame != NULL))
+      recorder_->push(arrivedFrame);
+    uv_mutex_unlock(&padlock);
+    return S_OK;
   }
-  else latestFrame_ = NULL;
-  if (arrivedAudio != NULL) {
-    arrivedAudio->AddRef();
-    latestAudio_ = arrivedAudio;
+  if (linked_.load(std::memory_order_relaxed)) {
+    uv_mutex_lock(&padlock);
+    if (link_ != NULL)
+      link_->linkFrame(arrivedFrame, arrivedAudio);
+    uv_mutex_unlock(&padlock);
+    return S_OK;
   }
-  else latestAudio_ = NULL;
-  uv_mutex_unlock(&padlock);
+  if (arrivedFrame != NULL) arrivedFrame->AddRef();
+  if (arrivedAudio != NULL) arrivedAudio->AddRef();
+  CaptureEntry entry;
+  entry.video = arrivedFrame;
+  entry.audio = arrivedAudio;
+  entry.arrivalTime = uv_hrtime();
+  entry.timeScale = m_timeScale;
+  entry.hasStreamTime = (arrivedFrame != NULL) &&
+    (arrivedFrame->GetStreamTime(&entry.streamTime, &entry.frameDuration, m_timeScale) == S_OK);
+  entry.hasHardwareTime = (arrivedFrame != NULL) &&
+    (arrivedFrame->GetHardwareReferenceTimestamp(m_timeScale,
+      &entry.hardwareTime, &entry.hardwareDuration) == S_OK);
+  entry.hasPacketTime = (arrivedAudio != NULL) &&
+    (arrivedAudio->GetPacketTime(&entry.packetTime, m_timeScale) == S_OK);
+  if (!frameQueue_.push(entry)) {
+    // JS has fallen more than a queue's length behind - drop the newest frame
+    if (arrivedFrame != NULL) arrivedFrame->Release();
+    if (arrivedAudio != NULL) arrivedAudio->Release();
+    framesDropped_.increment();
+    return S_OK;
+  }
+  queueHighWater_.max(frameQueue_.size());
   uv_async_send(async);
   return S_OK;
 }
 
+// Called on the input callback thread when format detection is enabled and
+// the incoming signal changes. Restarts the input in the new mode without
+// tearing down the capture, so only a few frames are lost.
 HRESULT	Capture::VideoInputFormatChanged (BMDVideoInputFormatChangedEvents notificationEvents, IDeckLinkDisplayMode* newDisplayMode, BMDDetectedVideoInputFormatFlags detectedSignalFlags) {
+  if (!formatDetection_ || (newDisplayMode == NULL))
+    return S_OK;
+
+  // Only this thread changes the mode, so it can be read here without the lock
+  if (newDisplayMode->GetDisplayMode() != (BMDDisplayMode) displayMode_) {
+    BMDVideoInputFlags inputFlags = bmdVideoInputFlagDefault | bmdVideoInputEnableFormatDetection;
+    m_deckLinkInput->PauseStreams();
+    if (m_deckLinkInput->EnableVideoInput(newDisplayMode->GetDisplayMode(),
+        (BMDPixelFormat) pixelFormat_, inputFlags) != S_OK) {
+      // Carry on in the previous mode rather than leave the input stopped
+      const char* error = "Failed to switch input to the detected display mode.";
+      if ((m_deckLinkInput->EnableVideoInput((BMDDisplayMode) displayMode_,
+            (BMDPixelFormat) pixelFormat_, inputFlags) != S_OK) ||
+          (m_deckLinkInput->FlushStreams() != S_OK) ||
+          (m_deckLinkInput->StartStreams() != S_OK))
+        error = "Failed to switch input to the detected display mode or restart it. Capture has stopped.";
+      uv_mutex_lock(&padlock);
+      formatError_ = error;
+      uv_mutex_unlock(&padlock);
+      uv_async_send(formatAsync);
+      return S_OK;
+    }
+    BMDTimeValue frameDuration;
+    BMDTimeScale timeScale;
+    newDisplayMode->GetFrameRate(&frameDuration, &timeScale);
+    uv_mutex_lock(&padlock);
+    displayMode_ = newDisplayMode->GetDisplayMode();
+    m_width = newDisplayMode->GetWidth();
+    m_height = newDisplayMode->GetHeight();
+    m_frameDuration = frameDuration;
+    m_timeScale = timeScale;
+    uv_mutex_unlock(&padlock);
+    m_deckLinkInput->FlushStreams();
+    m_deckLinkInput->StartStreams();
+  }
+  formatChanges_.increment();
+
+  uv_mutex_lock(&padlock);
+  pendingFormat_.displayMode = (BMDDisplayMode) displayMode_;
+  pendingFormat_.width = m_width;
+  pendingFormat_.height = m_height;
+  pendingFormat_.frameDuration = m_frameDuration;
+  pendingFormat_.timeScale = m_timeScale;
+  pendingFormat_.fieldDominance = newDisplayMode->GetFieldDominance();
+  pendingFormat_.signalFlags = detectedSignalFlags;
+  formatPending_ = true;
+  uv_mutex_unlock(&padlock);
+  uv_async_send(formatAsync);
   return S_OK;
 };
 
+NAUV_WORK_CB(Capture::FormatCallback) {
+  Nan::HandleScope scope;
+  Capture *capture = static_cast<Capture*>(async->data);
+  uv_mutex_lock(&capture->padlock);
+  bool pending = capture->formatPending_;
+  CaptureFormat format = capture->pendingFormat_;
+  const char* error = capture->formatError_;
+  capture->formatPending_ = false;
+  capture->formatError_ = NULL;
+  uv_mutex_unlock(&capture->padlock);
+  if (capture->formatCB_.IsEmpty())
+    return;
+  if (error != NULL) {
+    Nan::Callback cb(Nan::New(capture->formatCB_));
+    v8::Local<v8::Value> argv[1] = { Nan::Error(error) };
+    cb.Call(1, argv);
+  }
+  if (!pending)
+    return; // Only the latest of several quick changes is reported
+
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  Nan::Set(result, Nan::New("displayMode").ToLocalChecked(),
+    Nan::New<v8::Number>(format.displayMode));
+  Nan::Set(result, Nan::New("width").ToLocalChecked(),
+    Nan::New<v8::Number>((double) format.width));
+  Nan::Set(result, Nan::New("height").ToLocalChecked(),
+    Nan::New<v8::Number>((double) format.height));
+  Nan::Set(result, Nan::New("frameDuration").ToLocalChecked(),
+    Nan::New<v8::Number>((double) format.frameDuration));
+  Nan::Set(result, Nan::New("timeScale").ToLocalChecked(),
+    Nan::New<v8::Number>((double) format.timeScale));
+  Nan::Set(result, Nan::New("fieldDominance").ToLocalChecked(),
+    Nan::New<v8::Number>(format.fieldDominance));
+  Nan::Set(result, Nan::New("signalFlags").ToLocalChecked(),
+    Nan::New<v8::Number>(format.signalFlags));
+  Nan::Callback cb(Nan::New(capture->formatCB_));
+  v8::Local<v8::Value> argv[2] = { Nan::Null(), result };
+  cb.Call(2, argv);
+}
+
 void Capture::TestUV() {
   uv_async_send(async);
 }
 
-// void FreeCallback(char* data, void* hint) {
-//   Isolate* isolate = v8::Isolate::GetCurrent();
-//   IDeckLinkVideoInputFrame* frame = static_cast<IDeckLinkVideoInputFrame*>(hint);
-//   isolate->AdjustAmountOfExternalAllocatedMemory(-(frame->GetRowBytes() * frame->GetHeight()));
-//   frame->Release();
-// }
+// Buffer finalizers for zero copy mode. The DeckLink frame or packet stays
+// referenced for as long as JS holds the buffer that wraps its bytes.
+void FreeVideoFrame(char* data, void* hint) {
+  IDeckLinkVideoInputFrame* frame = static_cast<IDeckLinkVideoInputFrame*>(hint);
+  Nan::AdjustExternalMemory(-(int)(frame->GetRowBytes() * frame->GetHeight()));
+  frame->Release();
+}
+
+void FreePoolBuffer(char* data, void* hint) {
+  FramePoolSlot* slot = static_cast<FramePoolSlot*>(hint);
+  Nan::AdjustExternalMemory(-(int)slot->bytes);
+  slot->pool->release(slot);
+}
+
+void FreeAudioPacket(char* data, void* hint) {
+  IDeckLinkAudioInputPacket* packet = static_cast<IDeckLinkAudioInputPacket*>(hint);
+  packet->Release();
+}
+
+v8::Local<v8::Object> Capture::makeTiming(const CaptureEntry& entry) {
+  v8::Local<v8::Object> timing = Nan::New<v8::Object>();
+  Nan::Set(timing, Nan::New("timeScale").ToLocalChecked(),
+    Nan::New<v8::Number>((double) entry.timeScale));
+  Nan::Set(timing, Nan::New("arrivalTime").ToLocalChecked(),
+    Nan::New<v8::Number>((double) entry.arrivalTime));
+  if (entry.hasStreamTime) {
+    Nan::Set(timing, Nan::New("streamTime").ToLocalChecked(),
+      Nan::New<v8::Number>((double) entry.streamTime));
+    Nan::Set(timing, Nan::New("frameDuration").ToLocalChecked(),
+      Nan::New<v8::Number>((double) entry.frameDuration));
+  }
+  if (entry.hasHardwareTime) {
+    Nan::Set(timing, Nan::New("hardwareTime").ToLocalChecked(),
+      Nan::New<v8::Number>((double) entry.hardwareTime));
+    Nan::Set(timing, Nan::New("hardwareDuration").ToLocalChecked(),
+      Nan::New<v8::Number>((double) entry.hardwareDuration));
+  }
+  if (entry.hasPacketTime) {
+    Nan::Set(timing, Nan::New("audioPacketTime").ToLocalChecked(),
+      Nan::New<v8::Number>((double) entry.packetTime));
+  }
+  return timing;
+}
+
+void Capture::makeBuffers(const CaptureEntry& entry, v8::Local<v8::Value>& bv,
+    v8::Local<v8::Value>& ba) {
+  char* new_data;
+  char* new_audio;
+  bv = Nan::Null();
+  ba = Nan::Null();
+  if (entry.video != NULL) {
+    entry.video->GetBytes((void**) &new_data);
+    long new_data_size = entry.video->GetRowBytes() * entry.video->GetHeight();
+    BMDPixelFormat inputFormat = entry.video->GetPixelFormat();
+    bool converting = (outputFormat_ != (uint32_t) inputFormat) &&
+      canConvert(inputFormat, outputFormat_);
+    FramePoolSlot* slot = (!converting && (framePool_ != NULL)) ?
+      framePool_->retain(new_data) : NULL;
+    if (converting) {
+      // Convert into a new buffer, with rows split between threads
+      long width = entry.video->GetWidth();
+      long height = entry.video->GetHeight();
+      long rowBytes = FrameGeometry(outputFormat_, width, height).rowBytes;
+      bv = Nan::NewBuffer((uint32_t) (rowBytes * height)).ToLocalChecked();
+      convertFrame(new_data, entry.video->GetRowBytes(), inputFormat,
+        node::Buffer::Data(bv), rowBytes, outputFormat_, width, height);
+      framesConverted_.increment();
+      entry.video->Release();
+    } else if (slot != NULL) {
+      // Frame memory is pooled, so JS can keep it while the driver gets its
+      // frame back straight away
+      bv = Nan::NewBuffer(new_data, new_data_size, FreePoolBuffer,
+        slot).ToLocalChecked();
+      Nan::AdjustExternalMemory(slot->bytes);
+      entry.video->Release();
+    } else if (zeroCopy_) {
+      // Reference taken in VideoInputFrameArrived is handed to the buffer
+      bv = Nan::NewBuffer(new_data, new_data_size, FreeVideoFrame,
+        entry.video).ToLocalChecked();
+      Nan::AdjustExternalMemory(new_data_size);
+    } else {
+      bv = Nan::CopyBuffer(new_data, new_data_size).ToLocalChecked();
+      entry.video->Release();
+    }
+  }
+  if (entry.audio != NULL) {
+    entry.audio->GetBytes((void**) &new_audio);
+    long new_audio_size = entry.audio->GetSampleFrameCount() * sampleByteFactor_;
+    if (zeroCopy_) {
+      ba = Nan::NewBuffer(new_audio, new_audio_size, FreeAudioPacket,
+        entry.audio).ToLocalChecked();
+    } else {
+      ba = Nan::CopyBuffer(new_audio, new_audio_size).ToLocalChecked();
+      entry.audio->Release();
+    }
+  }
+}
 
 NAUV_WORK_CB(Capture::FrameCallback) {
   Nan::HandleScope scope;
   Capture *capture = static_cast<Capture*>(async->data);
   Nan::Callback cb(Nan::New(capture->captureCB_));
-  char* new_data;
-  char* new_audio;
-  v8::Local<v8::Value> bv = Nan::Null();
-  v8::Local<v8::Value> ba = Nan::Null();
-  uv_mutex_lock(&capture->padlock);
-  if (capture->latestFrame_ != NULL) {
-    capture->latestFrame_->GetBytes((void**) &new_data);
-    long new_data_size = capture->latestFrame_->GetRowBytes() * capture->latestFrame_->GetHeight();
-    // Local<Object> b = node::Buffer::New(isolate, new_data, new_data_size,
-    //   FreeCallback, capture->latestFrame_).ToLocalChecked();
-    bv = Nan::CopyBuffer(new_data, new_data_size).ToLocalChecked();
-    capture->latestFrame_->Release();
-  }
-  if (capture->latestAudio_ != NULL) {
-    capture->latestAudio_->GetBytes((void**) &new_audio);
-    long new_audio_size = capture->latestAudio_->GetSampleFrameCount() * capture->sampleByteFactor_;
-    // Local<Object> b = node::Buffer::New(isolate, new_data, new_data_size,
-    //   FreeCallback, capture->latestFrame_).ToLocalChecked();
-    ba = Nan::CopyBuffer(new_audio, new_audio_size).ToLocalChecked();
-    capture->latestAudio_->Release();
+  CaptureEntry entry;
+  v8::Local<v8::Value> bv;
+  v8::Local<v8::Value> ba;
+  uint64_t delivered = 0;
+  capture->asyncWakeups_.increment();
+  if (capture->batching_) {
+    // One call per batch of frames, each as { video, audio, timing }
+    bool more = true;
+    while (more) {
+      v8::Local<v8::Array> batch = Nan::New<v8::Array>();
+      uint32_t count = 0;
+      while (((capture->batchSize_ == 0) || (count < capture->batchSize_)) &&
+          (more = capture->frameQueue_.pop(entry))) {
+        capture->makeBuffers(entry, bv, ba);
+        v8::Local<v8::Object> item = Nan::New<v8::Object>();
+        Nan::Set(item, Nan::New("video").ToLocalChecked(), bv);
+        Nan::Set(item, Nan::New("audio").ToLocalChecked(), ba);
+        Nan::Set(item, Nan::New("timing").ToLocalChecked(), capture->makeTiming(entry));
+        Nan::Set(batch, count++, item);
+      }
+      if (count == 0) break;
+      v8::Local<v8::Value> argv[1] = { batch };
+      cb.Call(1, argv);
+      delivered += count;
+    }
+  } else {
+    // Sends to the async handle may have been merged, so drain everything queued
+    while (capture->frameQueue_.pop(entry)) {
+      capture->makeBuffers(entry, bv, ba);
+      v8::Local<v8::Value> argv[3] = { bv, ba, capture->makeTiming(entry) };
+      cb.Call(3, argv);
+      delivered++;
+    }
   }
-  uv_mutex_unlock(&capture->padlock);
-  // long extSize = isolate->AdjustAmountOfExternalAllocatedMemory(new_data_size);
-  // if (extSize > 100000000) {
-  //   isolate->LowMemoryNotification();
-  //   printf("Requesting bin collection.\n");
-  // }
-  v8::Local<v8::Value> argv[2] = { bv, ba };
-  cb.Call(2, argv);
+  capture->framesDelivered_.increment(delivered);
+  if (delivered > 1)
+    capture->asyncMerged_.increment(delivered - 1);
 }
 
 }
@@ -50,9 +50,48 @@
 #include <nan.h>
 
 #include "DeckLinkAPI.h"
+#include "RingBuffer.h"
+#include "FramePool.h"
+#include "StatCounter.h"
+#include "Recorder.h"
+#include "Playback.h"
+
+// Maximum number of captured frames waiting for delivery to JS
+#define CAPTURE_QUEUE_DEPTH 32
 
 namespace streampunk {
 
+// A frame and its audio as handed from the input callback to the event loop.
+// Either pointer may be NULL; each non-NULL pointer holds one reference.
+// Times are taken on the driver thread, in units of the display mode's time
+// scale. Each time is only valid when its matching has...Time flag is set.
+struct CaptureEntry {
+  IDeckLinkVideoInputFrame* video;
+  IDeckLinkAudioInputPacket* audio;
+  uint64_t arrivalTime; // uv_hrtime() on the driver thread, in nanoseconds
+  BMDTimeScale timeScale; // of the display mode when the frame arrived
+  bool hasStreamTime;
+  BMDTimeValue streamTime;
+  BMDTimeValue frameDuration;
+  bool hasHardwareTime;
+  BMDTimeValue hardwareTime;
+  BMDTimeValue hardwareDuration;
+  bool hasPacketTime;
+  BMDTimeValue packetTime;
+};
+
+// The input format after a detected change, passed from the input callback
+// thread to the event loop.
+struct CaptureFormat {
+  BMDDisplayMode displayMode;
+  long width;
+  long height;
+  BMDTimeValue frameDuration;
+  BMDTimeScale timeScale;
+  BMDFieldDominance fieldDominance;
+  BMDDetectedVideoInputFormatFlags signalFlags;
+};
+
 class Capture : public IDeckLinkInputCallback, public Nan::ObjectWrap
 {
 private:
@@ -76,7 +115,9 @@ private:
   // bool						m_waitingForCaptureEnd;
   // bool						m_captureStarted;
 
-  // video mode
+  // video mode, with displayMode_. Changed by the input callback thread
+  // when format detection switches modes, so written and read on the event
+  // loop under padlock.
   long						m_width;
   long						m_height;
   BMDTimeScale				m_timeScale;
@@ -87,12 +128,28 @@ private:
   // uint32_t					m_outPointFrameCount;
 
   // setup the IDeckLinkInput interface (video standard, pixel format, callback object, ...)
-  bool setupDeckLinkInput();
+  // Returns NULL on success, or a message describing the failure.
+  const char* setupDeckLinkInput();
 
   HRESULT setupAudioInput(BMDAudioSampleRate sampleRate, BMDAudioSampleType sampleType,
     uint32_t channelCount);
 
   void cleanupDeckLinkInput();
+  // drop the references to the device taken by init
+  void releaseDeckLink();
+
+  // the display mode, which may be changed by format detection
+  uint32_t currentMode();
+
+  // release any frames that were queued but not delivered
+  void drainFrameQueue();
+
+  v8::Local<v8::Object> makeTiming(const CaptureEntry& entry);
+
+  // Wrap or copy an entry's frame and audio for JS, releasing references
+  // that are not handed over to the buffers.
+  void makeBuffers(const CaptureEntry& entry, v8::Local<v8::Value>& video,
+    v8::Local<v8::Value>& audio);
 
   // init() must be called after the constructor.
   // if init() fails, call the destructor
@@ -106,18 +163,102 @@ private:
 
   static NAN_METHOD(EnableAudio);
 
+  static NAN_METHOD(EnableZeroCopy);
+
+  static NAN_METHOD(EnableFramePool);
+
+  static NAN_METHOD(SetOutputFormat);
+
+  static NAN_METHOD(GetStats);
+
+  static NAN_METHOD(EnableBatching);
+
+  static NAN_METHOD(StartRecording);
+
+  static NAN_METHOD(StopRecording);
+
+  static NAUV_WORK_CB(RecordCallback);
+
+  // stop and delete any recorder, returning its final statistics
+  v8::Local<v8::Object> stopRecorder();
+
+  v8::Local<v8::Object> makeRecordStats(Recorder* recorder);
+
+  static NAN_METHOD(Link);
+
+  static NAN_METHOD(Unlink);
+
+
+  static NAN_METHOD(EnableFormatDetection);
+
+  static NAUV_WORK_CB(FormatCallback);
+
   static NAUV_WORK_CB(FrameCallback);
 
   uint32_t deviceIndex_;
   uint32_t displayMode_;
   uint32_t pixelFormat_;
   uint32_t sampleByteFactor_;
+  // When set, buffers passed to JS wrap the DeckLink frame bytes directly and
+  // the frame is released by the buffer's finalizer.
+  bool zeroCopy_;
+  // Pixel format of the frames passed to JS. Frames captured in another
+  // format are converted into new buffers on the event loop.
+  uint32_t outputFormat_;
+  // Native buffer pool for captured frames, created when capture starts if
+  // enabled. A slot count of zero sizes the pool from the display mode.
+  bool poolEnabled_;
+  bool poolHugePages_;
+  uint32_t poolSlots_;
+  FramePool* framePool_;
+  // When batching, queued frames are passed to JS as arrays of up to
+  // batchSize_ frames per call, or all pending frames if batchSize_ is zero.
+  bool batching_;
+  uint32_t batchSize_;
+  // While recording, frames go straight from the input callback to the
+  // recorder's writer thread and are not delivered to JS. recorder_ is
+  // guarded by padlock; recording_ lets the callback skip the lock otherwise.
+  Recorder* recorder_;
+  std::atomic<bool> recording_;
+  uv_async_t *recordAsync;
+  Nan::Persistent<v8::Function> recordCB_;
+  // While linked, frames and audio go straight from the input callback to
+  // the playback's scheduler and are not delivered to JS. link_ is guarded
+  // by padlock; linked_ lets the callback skip the lock otherwise. linkObj_
+  // keeps the playback's JS object alive while linked.
+  Playback* link_;
+  std::atomic<bool> linked_;
+  Nan::Persistent<v8::Object> linkObj_;
+  // When set, the input follows changes in the incoming signal's format,
+  // reporting each change through formatCB_. The latest format waits in
+  // pendingFormat_, guarded by padlock, for the event loop. A failure to
+  // switch modes is reported through formatError_ in the same way.
+  bool formatDetection_;
+  bool formatPending_;
+  CaptureFormat pendingFormat_;
+  const char* formatError_;
+  uv_async_t *formatAsync;
+  Nan::Persistent<v8::Function> formatCB_;
   Nan::Persistent<v8::Function> captureCB_;
-  IDeckLinkVideoInputFrame* latestFrame_;
-  IDeckLinkAudioInputPacket* latestAudio_;
+  RingBuffer<CaptureEntry> frameQueue_;
+
+  // Written on the input callback thread
+  StatCounter framesArrived_;
+  StatCounter framesDropped_;
+  StatCounter queueHighWater_;
+  StatCounter formatChanges_;
+  // Written on the event loop thread
+  StatCounter framesDelivered_;
+  StatCounter framesConverted_;
+  StatCounter asyncWakeups_;
+  StatCounter asyncMerged_;
 public:
   static NAN_MODULE_INIT(Init);
 
+  // End any link to a playback, letting the playback object be collected.
+  // Event loop thread only.
+  void unlinkPlayback();
+
   // IDeckLinkInputCallback
   virtual HRESULT	VideoInputFormatChanged (BMDVideoInputFormatChangedEvents notificationEvents, IDeckLinkDisplayMode* newDisplayMode, BMDDetectedVideoInputFormatFlags detectedSignalFlags);
   virtual HRESULT	VideoInputFrameArrived (IDeckLinkVideoInputFrame* arrivedFrame, IDeckLinkAudioInputPacket*);
@@ -0,0 +1,792 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "Convert.h"
+#include "DeckLinkAPI.h"
+#include <uv.h>
+#include <string.h>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CONVERT_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CONVERT_TARGET(isa)
+#else
+#define CONVERT_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// Row kernels are built from small functions that must be inlined into each
+// instantiation, so that the AVX2 copies are compiled for AVX2 throughout
+#ifdef _MSC_VER
+#define CONVERT_INLINE __forceinline
+#else
+#define CONVERT_INLINE inline __attribute__((always_inline))
+#endif
+
+// Pixels converted at a time through the intermediate buffers. A multiple of
+// the pixels in a group of every format.
+#define CONVERT_CHUNK 96
+
+namespace streampunk {
+
+// A .yuv10 word holds its samples at bits 31-22, 21-12 and 11-2 of a big
+// endian word, where v210 holds the same samples at bits 0-9, 10-19 and
+// 20-29 of a little endian word. Byte swapping gives the big endian value,
+// then the first and third samples swap ends and the middle one moves down.
+// Words are independent, so every kernel converts in place.
+
+static inline uint32_t repackWord(uint32_t w) {
+  return (w >> 22) | ((w >> 2) & 0x000ffc00) | ((w << 18) & 0x3ff00000);
+}
+
+static void yuv10ToV210Scalar(const uint8_t* src, uint8_t* dst, size_t words) {
+  for ( size_t x = 0 ; x < words ; x++ ) {
+    const uint8_t* s = src + x * 4;
+    uint32_t w = repackWord(((uint32_t) s[0] << 24) | ((uint32_t) s[1] << 16) |
+      ((uint32_t) s[2] << 8) | (uint32_t) s[3]);
+    uint8_t* d = dst + x * 4;
+    d[0] = (uint8_t) w;
+    d[1] = (uint8_t) (w >> 8);
+    d[2] = (uint8_t) (w >> 16);
+    d[3] = (uint8_t) (w >> 24);
+  }
+}
+
+#ifdef CONVERT_X86
+
+CONVERT_TARGET("ssse3")
+static void yuv10ToV210SSSE3(const uint8_t* src, uint8_t* dst, size_t words) {
+  const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  const __m128i middle = _mm_set1_epi32(0x000ffc00);
+  const __m128i top = _mm_set1_epi32(0x3ff00000);
+  size_t x = 0;
+  for ( ; x + 4 <= words ; x += 4 ) {
+    __m128i w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + x * 4)), swap);
+    __m128i v = _mm_or_si128(_mm_srli_epi32(w, 22),
+      _mm_or_si128(_mm_and_si128(_mm_srli_epi32(w, 2), middle),
+        _mm_and_si128(_mm_slli_epi32(w, 18), top)));
+    _mm_storeu_si128((__m128i*) (dst + x * 4), v);
+  }
+  yuv10ToV210Scalar(src + x * 4, dst + x * 4, words - x);
+}
+
+CONVERT_TARGET("avx2")
+static void yuv10ToV210AVX2(const uint8_t* src, uint8_t* dst, size_t words) {
+  const __m256i swap = _mm256_set_epi8(
+    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  const __m256i middle = _mm256_set1_epi32(0x000ffc00);
+  const __m256i top = _mm256_set1_epi32(0x3ff00000);
+  size_t x = 0;
+  for ( ; x + 8 <= words ; x += 8 ) {
+    __m256i w = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (src + x * 4)), swap);
+    __m256i v = _mm256_or_si256(_mm256_srli_epi32(w, 22),
+      _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(w, 2), middle),
+        _mm256_and_si256(_mm256_slli_epi32(w, 18), top)));
+    _mm256_storeu_si256((__m256i*) (dst + x * 4), v);
+  }
+  yuv10ToV210Scalar(src + x * 4, dst + x * 4, words - x);
+}
+
+static bool hasAVX2() {
+  #ifdef _MSC_VER
+  int regs[4];
+  __cpuid(regs, 1);
+  // The OS must save the wide registers as well as the CPU having them
+  if (((regs[2] & (1 << 27)) == 0) || ((_xgetbv(0) & 6) != 6))
+    return false;
+  __cpuidex(regs, 7, 0);
+  return (regs[1] & (1 << 5)) != 0;
+  #else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+  #endif
+}
+
+static bool hasSSSE3() {
+  #ifdef _MSC_VER
+  int regs[4];
+  __cpuid(regs, 1);
+  return (regs[2] & (1 << 9)) != 0;
+  #else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("ssse3");
+  #endif
+}
+
+#endif
+
+
+// Everything else converts through three intermediate planes of 16-bit
+// values, at video levels whatever the format, so that 8, 10 and 12-bit
+// values keep their precision: Y, Cb and Cr for YUV formats and R, G and B
+// for RGB formats. Each format unpacks whole groups of pixels into the planes
+// and packs them back out. 4:2:2 chroma is repeated for both pixels of a pair
+// on unpacking and averaged on packing.
+
+// Video levels in 16 bits
+#define CONVERT_BLACK 4096  // 64 << 6
+#define CONVERT_WHITE 60160 // 940 << 6
+#define CONVERT_ZERO 32768  // colour difference zero, 512 << 6
+
+static CONVERT_INLINE uint32_t read32LE(const uint8_t* p) {
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) |
+    ((uint32_t) p[3] << 24);
+}
+
+static CONVERT_INLINE uint32_t read32BE(const uint8_t* p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+    ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static CONVERT_INLINE void write32LE(uint8_t* p, uint32_t w) {
+  p[0] = (uint8_t) w; p[1] = (uint8_t) (w >> 8);
+  p[2] = (uint8_t) (w >> 16); p[3] = (uint8_t) (w >> 24);
+}
+
+static CONVERT_INLINE void write32BE(uint8_t* p, uint32_t w) {
+  p[0] = (uint8_t) (w >> 24); p[1] = (uint8_t) (w >> 16);
+  p[2] = (uint8_t) (w >> 8); p[3] = (uint8_t) w;
+}
+
+// Round a 16-bit value down to bits, saturating at the top
+template <int bits>
+static CONVERT_INLINE uint32_t down(uint32_t v) {
+  uint32_t r = (v + (1u << (15 - bits))) >> (16 - bits);
+  return (r > (1u << bits) - 1) ? (1u << bits) - 1 : r;
+}
+
+// Round a full range 16-bit value to bits, the inverse of repeating the top
+// bits of a full range value to fill 16 bits
+template <int bits>
+static CONVERT_INLINE uint32_t fullDown(uint32_t v) {
+  return (v * ((1u << bits) - 1) + 32767) / 65535;
+}
+
+static CONVERT_INLINE uint16_t clamp16(int32_t v) {
+  return (uint16_t) ((v < 0) ? 0 : ((v > 65535) ? 65535 : v));
+}
+
+// Between full range 16-bit RGB and video levels, rounding to nearest so that
+// full range values survive a round trip
+static CONVERT_INLINE uint16_t fullToVideo(uint32_t v) {
+  return (uint16_t) (CONVERT_BLACK + ((v * 56065 + 32768) >> 16));
+}
+
+static CONVERT_INLINE uint32_t videoToFull(uint32_t v) {
+  v = (v < CONVERT_BLACK) ? CONVERT_BLACK : ((v > CONVERT_WHITE) ? CONVERT_WHITE : v);
+  return ((v - CONVERT_BLACK) * 76607 + 32768) >> 16;
+}
+
+// 'UYVY' - 4:2:2 8-bit, U Y0 V Y1
+struct Format2vuy {
+  enum { yuv = 1, groupPixels = 2, groupBytes = 4 };
+  static CONVERT_INLINE void unpack(const uint8_t* s, uint16_t* a, uint16_t* b,
+      uint16_t* c, long groups) {
+    for ( long g = 0 ; g < groups ; g++, s += 4, a += 2, b += 2, c += 2 ) {
+      b[0] = b[1] = (uint16_t) (s[0] << 8);
+      a[0] = (uint16_t) (s[1] << 8);
+      c[0] = c[1] = (uint16_t) (s[2] << 8);
+      a[1] = (uint16_t) (s[3] << 8);
+    }
+  }
+  static CONVERT_INLINE void pack(const uint16_t* a, const uint16_t* b,
+      const uint16_t* c, uint8_t* d, long groups) {
+    for ( long g = 0 ; g < groups ; g++, d += 4, a += 2, b += 2, c += 2 ) {
+      d[0] = (uint8_t) down<8>((b[0] + b[1] + 1) >> 1);
+      d[1] = (uint8_t) down<8>(a[0]);
+      d[2] = (uint8_t) down<8>((c[0] + c[1] + 1) >> 1);
+      d[3] = (uint8_t) down<8>(a[1]);
+    }
+  }
+};
+
+// 4:2:2 10-bit in groups of six pixels in four words of three samples, in
+// the order U Y0 V Y1 U Y2 V Y3 U Y4 V Y5. Word gives where samples sit.
+template <class Word>
+struct Format422Words {
+  enum { yuv = 1, groupPixels = 6, groupBytes = 16 };
+  static CONVERT_INLINE void unpack(const uint8_t* s, uint16_t* a, uint16_t* b,
+      uint16_t* c, long groups) {
+    for ( long g = 0 ; g < groups ; g++, s += 16, a += 6, b += 6, c += 6 ) {
+      uint32_t w0 = Word::read(s), w1 = Word::read(s + 4);
+      uint32_t w2 = Word::read(s + 8), w3 = Word::read(s + 12);
+      b[0] = b[1] = Word::sample(w0, 0); a[0] = Word::sample(w0, 1);
+      c[0] = c[1] = Word::sample(w0, 2); a[1] = Word::sample(w1, 0);
+      b[2] = b[3] = Word::sample(w1, 1); a[2] = Word::sample(w1, 2);
+      c[2] = c[3] = Word::sample(w2, 0); a[3] = Word::sample(w2, 1);
+      b[4] = b[5] = Word::sample(w2, 2); a[4] = Word::sample(w3, 0);
+      c[4] = c[5] = Word::sample(w3, 1); a[5] = Word::sample(w3, 2);
+    }
+  }
+  static CONVERT_INLINE void pack(const uint16_t* a, const uint16_t* b,
+      const uint16_t* c, uint8_t* d, long groups) {
+    for ( long g = 0 ; g < groups ; g++, d += 16, a += 6, b += 6, c += 6 ) {
+      uint32_t cb0 = down<10>((b[0] + b[1] + 1) >> 1), cr0 = down<10>((c[0] + c[1] + 1) >> 1);
+      uint32_t cb1 = down<10>((b[2] + b[3] + 1) >> 1), cr1 = down<10>((c[2] + c[3] + 1) >> 1);
+      uint32_t cb2 = down<10>((b[4] + b[5] + 1) >> 1), cr2 = down<10>((c[4] + c[5] + 1) >> 1);
+      Word::write(d, Word::word(cb0, down<10>(a[0]), cr0));
+      Word::write(d + 4, Word::word(down<10>(a[1]), cb1, down<10>(a[2])));
+      Word::write(d + 8, Word::word(cr1, down<10>(a[3]), cb2));
+      Word::write(d + 12, Word::word(down<10>(a[4]), cr2, down<10>(a[5])));
+    }
+  }
+};
+
+// v210 - little endian words, first sample at the bottom
+struct WordV210 {
+  static CONVERT_INLINE uint32_t read(const uint8_t* p) { return read32LE(p); }
+  static CONVERT_INLINE void write(uint8_t* p, uint32_t w) { write32LE(p, w); }
+  static CONVERT_INLINE uint16_t sample(uint32_t w, int x) {
+    return (uint16_t) (((w >> (x * 10)) & 0x3ff) << 6);
+  }
+  static CONVERT_INLINE uint32_t word(uint32_t s0, uint32_t s1, uint32_t s2) {
+    return s0 | (s1 << 10) | (s2 << 20);
+  }
+};
+
+// .yuv10 - big endian words, first sample at the top
+struct WordYUV10 {
+  static CONVERT_INLINE uint32_t read(const uint8_t* p) { return read32BE(p); }
+  static CONVERT_INLINE void write(uint8_t* p, uint32_t w) { write32BE(p, w); }
+  static CONVERT_INLINE uint16_t sample(uint32_t w, int x) {
+    return (uint16_t) (((w >> (22 - x * 10)) & 0x3ff) << 6);
+  }
+  static CONVERT_INLINE uint32_t word(uint32_t s0, uint32_t s1, uint32_t s2) {
+    return (s0 << 22) | (s1 << 12) | (s2 << 2);
+  }
+};
+
+typedef Format422Words<WordV210> FormatV210;
+typedef Format422Words<WordYUV10> FormatYUV10;
+
+// 8-bit full range RGB with alpha, at the given byte offsets. Alpha is
+// ignored when unpacking and opaque when packing.
+template <int R, int G, int B, int A>
+struct Format8BitRGB {
+  enum { yuv = 0, groupPixels = 1, groupBytes = 4 };
+  static CONVERT_INLINE void unpack(const uint8_t* s, uint16_t* a, uint16_t* b,
+      uint16_t* c, long groups) {
+    for ( long g = 0 ; g < groups ; g++, s += 4 ) {
+      a[g] = fullToVideo(s[R] * 257);
+      b[g] = fullToVideo(s[G] * 257);
+      c[g] = fullToVideo(s[B] * 257);
+    }
+  }
+  static CONVERT_INLINE void pack(const uint16_t* a, const uint16_t* b,
+      const uint16_t* c, uint8_t* d, long groups) {
+    for ( long g = 0 ; g < groups ; g++, d += 4 ) {
+      d[R] = (uint8_t) fullDown<8>(videoToFull(a[g]));
+      d[G] = (uint8_t) fullDown<8>(videoToFull(b[g]));
+      d[B] = (uint8_t) fullDown<8>(videoToFull(c[g]));
+      d[A] = 255;
+    }
+  }
+};
+
+typedef Format8BitRGB<1, 2, 3, 0> FormatARGB;
+typedef Format8BitRGB<2, 1, 0, 3> FormatBGRA;
+
+// 10-bit video level RGB, one pixel per word with components at the given
+// shifts
+template <bool bigEndian, int R, int G, int B>
+struct Format10BitRGB {
+  enum { yuv = 0, groupPixels = 1, groupBytes = 4 };
+  static CONVERT_INLINE void unpack(const uint8_t* s, uint16_t* a, uint16_t* b,
+      uint16_t* c, long groups) {
+    for ( long g = 0 ; g < groups ; g++, s += 4 ) {
+      uint32_t w = bigEndian ? read32BE(s) : read32LE(s);
+      a[g] = (uint16_t) (((w >> R) & 0x3ff) << 6);
+      b[g] = (uint16_t) (((w >> G) & 0x3ff) << 6);
+      c[g] = (uint16_t) (((w >> B) & 0x3ff) << 6);
+    }
+  }
+  static CONVERT_INLINE void pack(const uint16_t* a, const uint16_t* b,
+      const uint16_t* c, uint8_t* d, long groups) {
+    for ( long g = 0 ; g < groups ; g++, d += 4 ) {
+      uint32_t w = (down<10>(a[g]) << R) | (down<10>(b[g]) << G) | (down<10>(c[g]) << B);
+      if (bigEndian) write32BE(d, w); else write32LE(d, w);
+    }
+  }
+};
+
+typedef Format10BitRGB<true, 20, 10, 0> FormatR210;
+typedef Format10BitRGB<true, 22, 12, 2> FormatR10b;
+typedef Format10BitRGB<false, 22, 12, 2> FormatR10l;
+
+// 12-bit full range RGB, eight pixels in nine words. Components R0 G0 B0 R1
+// ... are packed from the bottom bit of the first word up, carrying on into
+// the next word, so every three words hold eight whole components.
+template <bool bigEndian>
+struct Format12BitRGB {
+  enum { yuv = 0, groupPixels = 8, groupBytes = 36 };
+  static CONVERT_INLINE uint32_t read(const uint8_t* p) {
+    return bigEndian ? read32BE(p) : read32LE(p);
+  }
+  static CONVERT_INLINE void write(uint8_t* p, uint32_t w) {
+    if (bigEndian) write32BE(p, w); else write32LE(p, w);
+  }
+  // Bits are moved in one pass and levels scaled in another, so that the
+  // scaling vectorises
+  static CONVERT_INLINE void unpack(const uint8_t* s, uint16_t* a, uint16_t* b,
+      uint16_t* c, long groups) {
+    uint16_t* planes[3] = { a, b, c };
+    for ( long g = 0 ; g < groups ; g++, a += 8, b += 8, c += 8 ) {
+      uint16_t v[24];
+      for ( int x = 0 ; x < 24 ; x += 8, s += 12 ) {
+        uint32_t w0 = read(s), w1 = read(s + 4), w2 = read(s + 8);
+        v[x] = w0 & 0xfff;
+        v[x + 1] = (w0 >> 12) & 0xfff;
+        v[x + 2] = (w0 >> 24) | ((w1 & 0xf) << 8);
+        v[x + 3] = (w1 >> 4) & 0xfff;
+        v[x + 4] = (w1 >> 16) & 0xfff;
+        v[x + 5] = (w1 >> 28) | ((w2 & 0xff) << 4);
+        v[x + 6] = (w2 >> 8) & 0xfff;
+        v[x + 7] = w2 >> 20;
+      }
+      for ( int x = 0 ; x < 8 ; x++ ) {
+        a[x] = v[x * 3]; b[x] = v[x * 3 + 1]; c[x] = v[x * 3 + 2];
+      }
+    }
+    for ( int p = 0 ; p < 3 ; p++ )
+      for ( long x = 0 ; x < groups * 8 ; x++ )
+        planes[p][x] = fullToVideo((planes[p][x] << 4) | (planes[p][x] >> 8));
+  }
+  static CONVERT_INLINE void pack(const uint16_t* a, const uint16_t* b,
+      const uint16_t* c, uint8_t* d, long groups) {
+    uint16_t codes[3][CONVERT_CHUNK];
+    const uint16_t* planes[3] = { a, b, c };
+    for ( int p = 0 ; p < 3 ; p++ )
+      for ( long x = 0 ; x < groups * 8 ; x++ )
+        codes[p][x] = (uint16_t) fullDown<12>(videoToFull(planes[p][x]));
+    for ( long g = 0 ; g < groups ; g++ ) {
+      uint32_t v[24];
+      for ( int x = 0 ; x < 8 ; x++ ) {
+        v[x * 3] = codes[0][g * 8 + x];
+        v[x * 3 + 1] = codes[1][g * 8 + x];
+        v[x * 3 + 2] = codes[2][g * 8 + x];
+      }
+      for ( int x = 0 ; x < 24 ; x += 8, d += 12 ) {
+        write(d, v[x] | (v[x + 1] << 12) | (v[x + 2] << 24));
+        write(d + 4, (v[x + 2] >> 8) | (v[x + 3] << 4) | (v[x + 4] << 16) | (v[x + 5] << 28));
+        write(d + 8, (v[x + 5] >> 4) | (v[x + 6] << 8) | (v[x + 7] << 20));
+      }
+    }
+  }
+};
+
+typedef Format12BitRGB<true> FormatR12B;
+typedef Format12BitRGB<false> FormatR12L;
+
+// Colour matrix coefficients, scaled by 2^13, between video level Y'CbCr and
+// video level R'G'B'
+struct ConvertMatrix {
+  int32_t crR, cbG, crG, cbB; // to RGB
+  int32_t kr, kg, kb, cbScale, crScale; // to YUV
+};
+
+static ConvertMatrix makeMatrix(double kr, double kb) {
+  double kg = 1.0 - kr - kb;
+  double range = 219.0 / 224.0; // Y' range over colour difference range
+  ConvertMatrix m;
+  m.crR = (int32_t) (2.0 * (1.0 - kr) * range * 8192.0 + 0.5);
+  m.cbG = (int32_t) (2.0 * (1.0 - kb) * kb / kg * range * 8192.0 + 0.5);
+  m.crG = (int32_t) (2.0 * (1.0 - kr) * kr / kg * range * 8192.0 + 0.5);
+  m.cbB = (int32_t) (2.0 * (1.0 - kb) * range * 8192.0 + 0.5);
+  m.kr = (int32_t) (kr * 8192.0 + 0.5);
+  m.kb = (int32_t) (kb * 8192.0 + 0.5);
+  m.kg = 8192 - m.kr - m.kb;
+  m.cbScale = (int32_t) (1.0 / (2.0 * (1.0 - kb) * range) * 8192.0 + 0.5);
+  m.crScale = (int32_t) (1.0 / (2.0 * (1.0 - kr) * range) * 8192.0 + 0.5);
+  return m;
+}
+
+static const ConvertMatrix matrix601 = makeMatrix(0.299, 0.114);
+static const ConvertMatrix matrix709 = makeMatrix(0.2126, 0.0722);
+
+template <bool fromYUV, bool toYUV>
+struct Colour {
+  static CONVERT_INLINE void apply(const ConvertMatrix& m, uint16_t* a,
+    uint16_t* b, uint16_t* c, long count) {}
+};
+
+template <>
+struct Colour<true, false> {
+  static CONVERT_INLINE void apply(const ConvertMatrix& m, uint16_t* a,
+      uint16_t* b, uint16_t* c, long count) {
+    for ( long x = 0 ; x < count ; x++ ) {
+      int32_t y = a[x], cb = b[x] - CONVERT_ZERO, cr = c[x] - CONVERT_ZERO;
+      a[x] = clamp16(y + ((m.crR * cr + 4096) >> 13));
+      b[x] = clamp16(y - ((m.cbG * cb + m.crG * cr + 4096) >> 13));
+      c[x] = clamp16(y + ((m.cbB * cb + 4096) >> 13));
+    }
+  }
+};
+
+template <>
+struct Colour<false, true> {
+  static CONVERT_INLINE void apply(const ConvertMatrix& m, uint16_t* a,
+      uint16_t* b, uint16_t* c, long count) {
+    for ( long x = 0 ; x < count ; x++ ) {
+      int32_t r = a[x], g = b[x], bl = c[x];
+      int32_t y = (m.kr * r + m.kg * g + m.kb * bl + 4096) >> 13;
+      a[x] = clamp16(y);
+      b[x] = clamp16(CONVERT_ZERO + ((m.cbScale * (bl - y) + 4096) >> 13));
+      c[x] = clamp16(CONVERT_ZERO + ((m.crScale * (r - y) + 4096) >> 13));
+    }
+  }
+};
+
+struct ConvertJob {
+  const uint8_t* src;
+  uint8_t* dst;
+  long srcRowBytes;
+  long dstRowBytes;
+  long width;
+  const ConvertMatrix* matrix;
+};
+
+// Converts the rows from first up to last of a job
+typedef void (*StripeFn)(const ConvertJob& job, long first, long last);
+
+template <class S, class D>
+struct RowKernel {
+  static CONVERT_INLINE void run(const ConvertJob& job, long first, long last) {
+    uint16_t a[CONVERT_CHUNK], b[CONVERT_CHUNK], c[CONVERT_CHUNK];
+    const long srcChunkBytes = CONVERT_CHUNK / S::groupPixels * S::groupBytes;
+    const long dstChunkBytes = CONVERT_CHUNK / D::groupPixels * D::groupBytes;
+    for ( long y = first ; y < last ; y++ ) {
+      const uint8_t* s = job.src + y * job.srcRowBytes;
+      uint8_t* d = job.dst + y * job.dstRowBytes;
+      for ( long x = 0 ; x < job.width ; x += CONVERT_CHUNK ) {
+        long n = (job.width - x < CONVERT_CHUNK) ? job.width - x : CONVERT_CHUNK;
+        long srcGroups = (n + S::groupPixels - 1) / S::groupPixels;
+        long dstGroups = (n + D::groupPixels - 1) / D::groupPixels;
+        S::unpack(s, a, b, c, srcGroups);
+        // Pad a partly used group of the destination with black
+        for ( long p = srcGroups * S::groupPixels ; p < dstGroups * D::groupPixels ; p++ ) {
+          a[p] = CONVERT_BLACK;
+          b[p] = c[p] = S::yuv ? CONVERT_ZERO : CONVERT_BLACK;
+        }
+        Colour<S::yuv != 0, D::yuv != 0>::apply(*job.matrix, a, b, c,
+          dstGroups * D::groupPixels);
+        D::pack(a, b, c, d, dstGroups);
+        s += srcChunkBytes;
+        d += dstChunkBytes;
+      }
+    }
+  }
+};
+
+template <class F>
+struct RowKernel<F, F> {
+  static CONVERT_INLINE void run(const ConvertJob& job, long first, long last) {
+    long bytes = (job.width + F::groupPixels - 1) / F::groupPixels * F::groupBytes;
+    for ( long y = first ; y < last ; y++ ) {
+      const uint8_t* s = job.src + y * job.srcRowBytes;
+      uint8_t* d = job.dst + y * job.dstRowBytes;
+      if (s != d) memcpy(d, s, bytes);
+    }
+  }
+};
+
+typedef void (*RepackKernel)(const uint8_t* src, uint8_t* dst, size_t words);
+
+struct KernelChoice {
+  RepackKernel yuv10ToV210;
+  const char* name;
+  bool avx2;
+};
+
+// Picked once, on first use, for the machine we are running on
+static const KernelChoice& kernel() {
+  static const KernelChoice choice = []() -> KernelChoice {
+    #ifdef CONVERT_X86
+    if (hasAVX2()) return KernelChoice { yuv10ToV210AVX2, "avx2", true };
+    if (hasSSSE3()) return KernelChoice { yuv10ToV210SSSE3, "ssse3", false };
+    #endif
+    return KernelChoice { yuv10ToV210Scalar, "scalar", false };
+  }();
+  return choice;
+}
+
+// The most common repack has its own hand written kernels
+template <>
+struct RowKernel<FormatYUV10, FormatV210> {
+  static CONVERT_INLINE void run(const ConvertJob& job, long first, long last) {
+    size_t words = (job.width + 5) / 6 * 4;
+    for ( long y = first ; y < last ; y++ )
+      kernel().yuv10ToV210(job.src + y * job.srcRowBytes,
+        job.dst + y * job.dstRowBytes, words);
+  }
+};
+
+template <class S, class D>
+static void convertStripe(const ConvertJob& job, long first, long last) {
+  RowKernel<S, D>::run(job, first, last);
+}
+
+#ifdef CONVERT_X86
+// The same loops, vectorised by the compiler for AVX2
+template <class S, class D>
+CONVERT_TARGET("avx2")
+static void convertStripeAVX2(const ConvertJob& job, long first, long last) {
+  RowKernel<S, D>::run(job, first, last);
+}
+#endif
+
+#define CONVERT_FORMAT_COUNT 10
+
+// Groups of pixels as the kernels see them. Padded row sizes are in the
+// pixel layouts of FrameGeometry.
+struct FormatInfo {
+  uint32_t format;
+  long groupPixels;
+  long groupBytes;
+};
+
+#define CONVERT_INFO(code, F) { code, F::groupPixels, F::groupBytes }
+
+static const FormatInfo formats[CONVERT_FORMAT_COUNT] = {
+  CONVERT_INFO(bmdFormat8BitYUV, Format2vuy),
+  CONVERT_INFO(bmdFormat10BitYUV, FormatV210),
+  CONVERT_INFO(bmdFormat8BitARGB, FormatARGB),
+  CONVERT_INFO(bmdFormat8BitBGRA, FormatBGRA),
+  CONVERT_INFO(bmdFormat10BitRGB, FormatR210),
+  CONVERT_INFO(bmdFormat12BitRGB, FormatR12B),
+  CONVERT_INFO(bmdFormat12BitRGBLE, FormatR12L),
+  CONVERT_INFO(bmdFormat10BitRGBXLE, FormatR10l),
+  CONVERT_INFO(bmdFormat10BitRGBX, FormatR10b),
+  CONVERT_INFO(convertFormatYUV10, FormatYUV10)
+};
+
+static int formatIndex(uint32_t format) {
+  for ( int x = 0 ; x < CONVERT_FORMAT_COUNT ; x++ )
+    if (formats[x].format == format) return x;
+  return -1;
+}
+
+template <class S, class D>
+static StripeFn stripeFn(bool avx2) {
+  #ifdef CONVERT_X86
+  if (avx2) return convertStripeAVX2<S, D>;
+  #endif
+  return convertStripe<S, D>;
+}
+
+// One row of the table, in the order of formats
+template <class S>
+static void fillStripeFns(StripeFn* row, bool avx2) {
+  row[0] = stripeFn<S, Format2vuy>(avx2);
+  row[1] = stripeFn<S, FormatV210>(avx2);
+  row[2] = stripeFn<S, FormatARGB>(avx2);
+  row[3] = stripeFn<S, FormatBGRA>(avx2);
+  row[4] = stripeFn<S, FormatR210>(avx2);
+  row[5] = stripeFn<S, FormatR12B>(avx2);
+  row[6] = stripeFn<S, FormatR12L>(avx2);
+  row[7] = stripeFn<S, FormatR10l>(avx2);
+  row[8] = stripeFn<S, FormatR10b>(avx2);
+  row[9] = stripeFn<S, FormatYUV10>(avx2);
+}
+
+struct StripeTable {
+  StripeFn fns[CONVERT_FORMAT_COUNT][CONVERT_FORMAT_COUNT];
+};
+
+static const StripeTable& stripeTable() {
+  static const StripeTable table = []() -> StripeTable {
+    StripeTable t;
+    bool avx2 = kernel().avx2;
+    fillStripeFns<Format2vuy>(t.fns[0], avx2);
+    fillStripeFns<FormatV210>(t.fns[1], avx2);
+    fillStripeFns<FormatARGB>(t.fns[2], avx2);
+    fillStripeFns<FormatBGRA>(t.fns[3], avx2);
+    fillStripeFns<FormatR210>(t.fns[4], avx2);
+    fillStripeFns<FormatR12B>(t.fns[5], avx2);
+    fillStripeFns<FormatR12L>(t.fns[6], avx2);
+    fillStripeFns<FormatR10l>(t.fns[7], avx2);
+    fillStripeFns<FormatR10b>(t.fns[8], avx2);
+    fillStripeFns<FormatYUV10>(t.fns[9], avx2);
+    return t;
+  }();
+  return table;
+}
+
+// Worker threads that share the rows of a frame with the converting thread.
+// One frame is striped at a time; a thread that finds the pool busy converts
+// its frame alone rather than waiting.
+class StripePool
+{
+public:
+  StripePool(uint32_t workers) : generation_(0), fn_(NULL), rows_(0),
+      stripeRows_(0), stripes_(0), next_(0), pending_(0) {
+    uv_mutex_init(&busy);
+    uv_mutex_init(&lock);
+    uv_cond_init(&wake);
+    uv_cond_init(&finished);
+    for ( uint32_t x = 0 ; x < workers ; x++ ) {
+      uv_thread_t thread;
+      if (uv_thread_create(&thread, workerThread, this) != 0) break;
+      threads_++;
+    }
+  }
+
+  void run(StripeFn fn, const ConvertJob& job, long rows) {
+    long stripes = rows / CONVERT_MIN_STRIPE;
+    if (stripes > threads_ + 1) stripes = threads_ + 1;
+    if ((stripes < 2) || (uv_mutex_trylock(&busy) != 0)) {
+      fn(job, 0, rows);
+      return;
+    }
+    uv_mutex_lock(&lock);
+    fn_ = fn;
+    job_ = job;
+    rows_ = rows;
+    stripes_ = stripes;
+    stripeRows_ = (rows + stripes - 1) / stripes;
+    next_ = 0;
+    pending_ = stripes;
+    generation_++;
+    uv_cond_broadcast(&wake);
+    work();
+    while (pending_ > 0)
+      uv_cond_wait(&finished, &lock);
+    uv_mutex_unlock(&lock);
+    uv_mutex_unlock(&busy);
+  }
+
+private:
+  // Convert unclaimed stripes of the current frame. lock must be held.
+  void work() {
+    while (next_ < stripes_) {
+      long first = next_++ * stripeRows_;
+      long last = (first + stripeRows_ < rows_) ? first + stripeRows_ : rows_;
+      StripeFn fn = fn_;
+      ConvertJob job = job_;
+      uv_mutex_unlock(&lock);
+      fn(job, first, last);
+      uv_mutex_lock(&lock);
+      if (--pending_ == 0)
+        uv_cond_signal(&finished);
+    }
+  }
+
+  static void workerThread(void* arg) {
+    StripePool* pool = static_cast<StripePool*>(arg);
+    uv_mutex_lock(&pool->lock);
+    uint64_t seen = pool->generation_;
+    while (true) {
+      while (pool->generation_ == seen)
+        uv_cond_wait(&pool->wake, &pool->lock);
+      seen = pool->generation_;
+      pool->work();
+    }
+  }
+
+  uv_mutex_t busy; // held while a frame is striped
+  uv_mutex_t lock; // guards everything below
+  uv_cond_t wake;
+  uv_cond_t finished;
+  long threads_ = 0;
+  uint64_t generation_;
+  StripeFn fn_;
+  ConvertJob job_;
+  long rows_;
+  long stripeRows_;
+  long stripes_;
+  long next_;
+  long pending_;
+};
+
+// Started on first use and kept for the life of the process
+static StripePool& stripePool() {
+  static StripePool pool([]() -> uint32_t {
+    uint32_t cpus = std::thread::hardware_concurrency();
+    if (cpus > CONVERT_MAX_THREADS) cpus = CONVERT_MAX_THREADS;
+    return (cpus > 1) ? cpus - 1 : 0;
+  }());
+  return pool;
+}
+
+bool canConvert(uint32_t srcFormat, uint32_t dstFormat) {
+  return (formatIndex(srcFormat) >= 0) && (formatIndex(dstFormat) >= 0);
+}
+
+static long packedRowBytes(const FormatInfo& info, long width) {
+  return (width + info.groupPixels - 1) / info.groupPixels * info.groupBytes;
+}
+
+static const char* convertRows(const char* src, long srcRowBytes, int srcIndex,
+    char* dst, long dstRowBytes, int dstIndex, long width, long height,
+    const ConvertMatrix* matrix) {
+  const FormatInfo& srcInfo = formats[srcIndex];
+  const FormatInfo& dstInfo = formats[dstIndex];
+  if ((srcRowBytes < packedRowBytes(srcInfo, width)) ||
+      (dstRowBytes < packedRowBytes(dstInfo, width)))
+    return "Row bytes are too small for the frame width.";
+  if ((src == dst) && ((srcRowBytes != dstRowBytes) ||
+      (srcInfo.groupBytes * dstInfo.groupPixels != dstInfo.groupBytes * srcInfo.groupPixels)))
+    return "Conversion in place needs formats with the same row size.";
+
+  ConvertJob job;
+  job.src = (const uint8_t*) src;
+  job.dst = (uint8_t*) dst;
+  job.srcRowBytes = srcRowBytes;
+  job.dstRowBytes = dstRowBytes;
+  job.width = width;
+  job.matrix = matrix;
+  stripePool().run(stripeTable().fns[srcIndex][dstIndex], job, height);
+  return NULL;
+}
+
+const char* convertFrame(const char* src, long srcRowBytes, uint32_t srcFormat,
+    char* dst, long dstRowBytes, uint32_t dstFormat, long width, long height) {
+  int srcIndex = formatIndex(srcFormat);
+  int dstIndex = formatIndex(dstFormat);
+  if ((srcIndex < 0) || (dstIndex < 0))
+    return "Conversion between these formats is not supported.";
+  return convertRows(src, srcRowBytes, srcIndex, dst, dstRowBytes, dstIndex,
+    width, height, (height < 720) ? &matrix601 : &matrix709);
+}
+
+size_t convertBuffer(const char* src, size_t srcLength, uint32_t srcFormat,
+    char* dst, size_t dstLength, uint32_t dstFormat, const char** error) {
+  int srcIndex = formatIndex(srcFormat);
+  int dstIndex = formatIndex(dstFormat);
+  if ((srcIndex < 0) || (dstIndex < 0)) {
+    *error = "Conversion between these formats is not supported.";
+    return 0;
+  }
+  const FormatInfo& srcInfo = formats[srcIndex];
+  long width = (long) (srcLength / srcInfo.groupBytes) * srcInfo.groupPixels;
+  long dstBytes = packedRowBytes(formats[dstIndex], width);
+  if (dstLength < (size_t) dstBytes) {
+    *error = "Destination buffer is too small for the converted frame.";
+    return 0;
+  }
+  // One long row with no frame size to go by, so assume HD colour
+  *error = convertRows(src, (long) srcLength, srcIndex, dst, (long) dstLength,
+    dstIndex, width, 1, &matrix709);
+  return (*error == NULL) ? (size_t) dstBytes : 0;
+}
+
+const char* convertKernel() {
+  return kernel().name;
+}
+
+} // namespace streampunk
@@ -0,0 +1,63 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Most threads, including the caller, that convert the rows of one frame
+#define CONVERT_MAX_THREADS 4
+// Fewest rows worth handing to another thread
+#define CONVERT_MIN_STRIPE 32
+
+namespace streampunk {
+
+// Pixel formats that the card does not play but that can be converted to one
+// it does. Codes are four character codes, like BMDPixelFormat values.
+enum ConvertFormat {
+  // EBU test material - 4:2:2 10-bit in words of three samples, U Y0 V Y1
+  // order as for v210, each word big endian with samples from the top bit
+  // down and two zero bits at the bottom
+  convertFormatYUV10 = /* 'yu10' */ 0x79753130
+};
+
+// True if frames can be converted from srcFormat to dstFormat. Any of the
+// DeckLink pixel formats and .yuv10 can be converted to any other.
+bool canConvert(uint32_t srcFormat, uint32_t dstFormat);
+
+// Convert a frame of width by height pixels from src to dst, with rows
+// starting every srcRowBytes and dstRowBytes. Conversion between YUV and RGB
+// uses Rec. 601 for frames under 720 lines and Rec. 709 otherwise. Rows are
+// split between threads for large frames. src and dst may be the same buffer
+// when both formats have the same row size. Returns an error message, or
+// NULL on success. Safe on any thread.
+const char* convertFrame(const char* src, long srcRowBytes, uint32_t srcFormat,
+  char* dst, long dstRowBytes, uint32_t dstFormat, long width, long height);
+
+// As convertFrame, for a buffer treated as one row of as many pixels as fit
+// in srcLength, using Rec. 709 for any conversion between YUV and RGB.
+// Returns the number of bytes written to dst, or 0 with the error set if dst
+// is too small or the conversion is not supported.
+size_t convertBuffer(const char* src, size_t srcLength, uint32_t srcFormat,
+  char* dst, size_t dstLength, uint32_t dstFormat, const char** error);
+
+// Name of the instruction set used for conversion on this machine
+const char* convertKernel();
+
+} // namespace streampunk
+
+#endif
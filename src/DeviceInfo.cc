@@ -0,0 +1,145 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "DeviceInfo.h"
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <comdef.h>
+#endif
+
+namespace streampunk {
+
+struct AttributeName {
+  BMDDeckLinkAttributeID id;
+  const char* name;
+};
+
+static const AttributeName flagAttributes[] = {
+  { BMDDeckLinkSupportsInternalKeying, "supportsInternalKeying" },
+  { BMDDeckLinkSupportsExternalKeying, "supportsExternalKeying" },
+  { BMDDeckLinkSupportsHDKeying, "supportsHDKeying" },
+  { BMDDeckLinkSupportsInputFormatDetection, "supportsInputFormatDetection" },
+  { BMDDeckLinkHasReferenceInput, "hasReferenceInput" },
+  { BMDDeckLinkHasSerialPort, "hasSerialPort" },
+  { BMDDeckLinkHasBypass, "hasBypass" },
+  { BMDDeckLinkSupportsClockTimingAdjustment, "supportsClockTimingAdjustment" },
+  { BMDDeckLinkSupportsFullDuplex, "supportsFullDuplex" },
+  { BMDDeckLinkSupportsFullFrameReferenceInputTimingOffset,
+    "supportsFullFrameReferenceInputTimingOffset" },
+  { BMDDeckLinkSupportsSMPTELevelAOutput, "supportsSMPTELevelAOutput" },
+  { BMDDeckLinkSupportsDualLinkSDI, "supportsDualLinkSDI" },
+  { BMDDeckLinkSupportsQuadLinkSDI, "supportsQuadLinkSDI" },
+  { BMDDeckLinkSupportsIdleOutput, "supportsIdleOutput" },
+  { BMDDeckLinkHasLTCTimecodeInput, "hasLTCTimecodeInput" },
+  { BMDDeckLinkSupportsDuplexModeConfiguration, "supportsDuplexModeConfiguration" },
+  { BMDDeckLinkSupportsHDRMetadata, "supportsHDRMetadata" }
+};
+
+static const AttributeName intAttributes[] = {
+  { BMDDeckLinkMaximumAudioChannels, "maximumAudioChannels" },
+  { BMDDeckLinkMaximumAnalogAudioInputChannels, "maximumAnalogAudioInputChannels" },
+  { BMDDeckLinkMaximumAnalogAudioOutputChannels, "maximumAnalogAudioOutputChannels" },
+  { BMDDeckLinkNumberOfSubDevices, "numberOfSubDevices" },
+  { BMDDeckLinkSubDeviceIndex, "subDeviceIndex" },
+  { BMDDeckLinkPersistentID, "persistentID" },
+  { BMDDeckLinkDeviceGroupID, "deviceGroupID" },
+  { BMDDeckLinkTopologicalID, "topologicalID" },
+  { BMDDeckLinkVideoOutputConnections, "videoOutputConnections" },
+  { BMDDeckLinkVideoInputConnections, "videoInputConnections" },
+  { BMDDeckLinkAudioOutputConnections, "audioOutputConnections" },
+  { BMDDeckLinkAudioInputConnections, "audioInputConnections" },
+  { BMDDeckLinkVideoIOSupport, "videoIOSupport" },
+  { BMDDeckLinkDeviceInterface, "deviceInterface" },
+  { BMDDeckLinkPairedDevicePersistentID, "pairedDevicePersistentID" }
+};
+
+// Indexed by device, with NULL for devices that have not been asked for
+static std::vector<DeviceInfo*> snapshots;
+
+#ifdef WIN32
+typedef BSTR DeckLinkString;
+typedef BOOL DeckLinkFlag;
+#elif __APPLE__
+typedef CFStringRef DeckLinkString;
+typedef bool DeckLinkFlag;
+#else
+typedef const char* DeckLinkString;
+typedef bool DeckLinkFlag;
+#endif
+
+// Take ownership of a string returned by the driver
+static std::string takeString(DeckLinkString value) {
+  #ifdef WIN32
+  _bstr_t name(value, false);
+  return std::string((char*) name);
+  #elif __APPLE__
+  char name [256];
+  CFStringGetCString(value, name, sizeof(name), kCFStringEncodingMacRoman);
+  CFRelease(value);
+  return std::string(name);
+  #else
+  std::string result(value);
+  free((void*) value);
+  return result;
+  #endif
+}
+
+const DeviceInfo* DeviceInfo::forDevice(uint32_t deviceIndex, IDeckLink* deckLink) {
+  if (deviceIndex >= snapshots.size())
+    snapshots.resize(deviceIndex + 1, NULL);
+  if (snapshots[deviceIndex] == NULL)
+    snapshots[deviceIndex] = new DeviceInfo(deckLink);
+  return snapshots[deviceIndex];
+}
+
+const DeviceInfo* DeviceInfo::cached(uint32_t deviceIndex) {
+  return (deviceIndex < snapshots.size()) ? snapshots[deviceIndex] : NULL;
+}
+
+DeviceInfo::DeviceInfo(IDeckLink* deckLink) : hasInput(false), hasOutput(false) {
+  DeckLinkString name;
+  if (deckLink->GetModelName(&name) == S_OK)
+    modelName = takeString(name);
+  if (deckLink->GetDisplayName(&name) == S_OK)
+    displayName = takeString(name);
+
+  IUnknown* deckLinkInterface = NULL;
+  if (deckLink->QueryInterface(IID_IDeckLinkInput, (void**) &deckLinkInterface) == S_OK) {
+    hasInput = true;
+    deckLinkInterface->Release();
+  }
+  if (deckLink->QueryInterface(IID_IDeckLinkOutput, (void**) &deckLinkInterface) == S_OK) {
+    hasOutput = true;
+    deckLinkInterface->Release();
+  }
+
+  IDeckLinkAttributes* deckLinkAttributes = NULL;
+  if (deckLink->QueryInterface(IID_IDeckLinkAttributes, (void**) &deckLinkAttributes) != S_OK)
+    return;
+  for ( auto& attribute : flagAttributes ) {
+    DeckLinkFlag flag;
+    if (deckLinkAttributes->GetFlag(attribute.id, &flag) == S_OK)
+      flags.push_back(std::make_pair(attribute.name, flag != 0));
+  }
+  for ( auto& attribute : intAttributes ) {
+    int64_t value;
+    if (deckLinkAttributes->GetInt(attribute.id, &value) == S_OK)
+      ints.push_back(std::make_pair(attribute.name, value));
+  }
+  deckLinkAttributes->Release();
+}
+
+} // namespace streampunk
@@ -0,0 +1,54 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef DEVICEINFO_H
+#define DEVICEINFO_H
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+namespace streampunk {
+
+// Snapshot of what a device can do, read from IDeckLinkAttributes once and
+// kept for the life of the process. Attributes the device does not report
+// are left out.
+class DeviceInfo
+{
+public:
+  // Snapshot of a device, taken from deckLink the first time it is asked
+  // for. JS thread only.
+  static const DeviceInfo* forDevice(uint32_t deviceIndex, IDeckLink* deckLink);
+  // Snapshot taken earlier, or NULL. JS thread only.
+  static const DeviceInfo* cached(uint32_t deviceIndex);
+
+  std::string modelName;
+  std::string displayName;
+  bool hasInput;
+  bool hasOutput;
+  // Flag and integer attributes, by the names used in JS
+  std::vector<std::pair<const char*, bool> > flags;
+  std::vector<std::pair<const char*, int64_t> > ints;
+
+private:
+  explicit DeviceInfo(IDeckLink* deckLink);
+};
+
+} // namespace streampunk
+
+#endif
@@ -0,0 +1,186 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "DeviceRegistry.h"
+
+namespace streampunk {
+
+// The IDs that recognise a device when it returns - the persistent ID where
+// the device has one, and its place on the bus
+static DeviceId deviceId(IDeckLink* deckLink) {
+  IDeckLinkAttributes* deckLinkAttributes = NULL;
+  DeviceId id = { 0, 0 };
+  if (deckLink->QueryInterface(IID_IDeckLinkAttributes, (void**) &deckLinkAttributes) != S_OK)
+    return id;
+  if (deckLinkAttributes->GetInt(BMDDeckLinkPersistentID, &id.persistent) != S_OK)
+    id.persistent = 0;
+  if (deckLinkAttributes->GetInt(BMDDeckLinkTopologicalID, &id.topological) != S_OK)
+    id.topological = 0;
+  deckLinkAttributes->Release();
+  return id;
+}
+
+// Whether two sets of IDs are of the same device. Another device in the same
+// slot has the same topological ID, so persistent IDs decide where both
+// have one.
+static bool sameDevice(const DeviceId& a, const DeviceId& b) {
+  if ((a.persistent != 0) && (b.persistent != 0))
+    return a.persistent == b.persistent;
+  return (a.topological != 0) && (a.topological == b.topological);
+}
+
+DeviceRegistry::DeviceRegistry() : discovery_(NULL), discoveryError_(NULL), notify_(NULL) {
+  uv_mutex_init(&padlock);
+}
+
+DeviceRegistry* DeviceRegistry::get() {
+  static DeviceRegistry* registry = NULL;
+  static bool started = false;
+  if (!started) {
+    started = true;
+    registry = new DeviceRegistry;
+    if (!registry->start()) {
+      delete registry;
+      registry = NULL;
+    }
+  }
+  return registry;
+}
+
+bool DeviceRegistry::start() {
+  IDeckLinkIterator* deckLinkIterator = NULL;
+  IDeckLink* deckLink;
+  #ifdef WIN32
+  CoCreateInstance(CLSID_CDeckLinkIterator, NULL, CLSCTX_ALL, IID_IDeckLinkIterator, (void**)&deckLinkIterator);
+  #else
+  deckLinkIterator = CreateDeckLinkIteratorInstance();
+  #endif
+  if (deckLinkIterator == NULL) return false; // No driver installed
+
+  // List the devices present now in the order existing code expects, keeping
+  // the iterator's reference to each
+  uv_mutex_lock(&padlock);
+  while (deckLinkIterator->Next(&deckLink) == S_OK) {
+    DeviceEntry entry = { deckLink, deviceId(deckLink) };
+    if (findLocked(deckLink, entry.id) >= 0)
+      deckLink->Release(); // Already listed
+    else
+      entries_.push_back(entry);
+  }
+  uv_mutex_unlock(&padlock);
+  deckLinkIterator->Release();
+
+  // Discovery reports the devices already listed first, which are matched
+  // by their IDs and ignored
+  #ifdef WIN32
+  CoCreateInstance(CLSID_CDeckLinkDiscovery, NULL, CLSCTX_ALL, IID_IDeckLinkDiscovery, (void**)&discovery_);
+  #else
+  discovery_ = CreateDeckLinkDiscoveryInstance();
+  #endif
+  if (discovery_ == NULL) {
+    discoveryError_ = "DeckLink device discovery is not available.";
+  } else if (discovery_->InstallDeviceNotifications(this) != S_OK) {
+    discoveryError_ = "Failed to install DeckLink device notifications.";
+    discovery_->Release();
+    discovery_ = NULL;
+  }
+  return true; // Devices listed so far can still be used
+}
+
+IDeckLink* DeviceRegistry::acquire(uint32_t index) {
+  IDeckLink* deckLink = NULL;
+  uv_mutex_lock(&padlock);
+  if (index < entries_.size()) {
+    deckLink = entries_[index].deckLink;
+    if (deckLink != NULL) deckLink->AddRef();
+  }
+  uv_mutex_unlock(&padlock);
+  return deckLink;
+}
+
+uint32_t DeviceRegistry::count() {
+  uv_mutex_lock(&padlock);
+  uint32_t count = (uint32_t) entries_.size();
+  uv_mutex_unlock(&padlock);
+  return count;
+}
+
+const char* DeviceRegistry::setNotify(uv_async_t* notify) {
+  uv_mutex_lock(&padlock);
+  notify_ = notify;
+  uv_mutex_unlock(&padlock);
+  return discoveryError_;
+}
+
+std::vector<DeviceEvent> DeviceRegistry::takeEvents() {
+  std::vector<DeviceEvent> events;
+  uv_mutex_lock(&padlock);
+  events.swap(events_);
+  uv_mutex_unlock(&padlock);
+  return events;
+}
+
+int DeviceRegistry::findLocked(IDeckLink* deckLink, const DeviceId& id) {
+  // Discovery may report a listed device with another object
+  for ( size_t x = 0 ; x < entries_.size() ; x++ ) {
+    if ((entries_[x].deckLink == deckLink) || sameDevice(entries_[x].id, id))
+      return (int) x;
+  }
+  return -1;
+}
+
+void DeviceRegistry::notify(uint32_t index, bool arrived) {
+  DeviceEvent event = { index, arrived };
+  events_.push_back(event);
+  if (notify_ != NULL)
+    uv_async_send(notify_);
+}
+
+HRESULT DeviceRegistry::DeckLinkDeviceArrived(IDeckLink* deckLinkDevice) {
+  DeviceId id = deviceId(deckLinkDevice);
+  uv_mutex_lock(&padlock);
+  int index = findLocked(deckLinkDevice, id);
+  if (index < 0) {
+    DeviceEntry entry = { deckLinkDevice, id };
+    entries_.push_back(entry);
+    index = (int) entries_.size() - 1;
+  } else if (entries_[index].deckLink == NULL) {
+    entries_[index].deckLink = deckLinkDevice;
+  } else { // Already listed
+    uv_mutex_unlock(&padlock);
+    return S_OK;
+  }
+  deckLinkDevice->AddRef();
+  notify((uint32_t) index, true);
+  uv_mutex_unlock(&padlock);
+  return S_OK;
+}
+
+HRESULT DeviceRegistry::DeckLinkDeviceRemoved(IDeckLink* deckLinkDevice) {
+  // Discovery may report a device with another object than the iterator's
+  DeviceId id = deviceId(deckLinkDevice);
+  uv_mutex_lock(&padlock);
+  int index = findLocked(deckLinkDevice, id);
+  if ((index >= 0) && (entries_[index].deckLink != NULL)) {
+    // Objects still using the device hold their own references
+    entries_[index].deckLink->Release();
+    entries_[index].deckLink = NULL;
+    notify((uint32_t) index, false);
+  }
+  uv_mutex_unlock(&padlock);
+  return S_OK;
+}
+
+} // namespace streampunk
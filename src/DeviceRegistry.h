@@ -0,0 +1,99 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef DEVICEREGISTRY_H
+#define DEVICEREGISTRY_H
+
+#include <uv.h>
+#include <stdint.h>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+namespace streampunk {
+
+// A device arriving at or leaving an index of the registry
+struct DeviceEvent {
+  uint32_t index;
+  bool arrived;
+};
+
+// The IDs that recognise a device, whichever object it is reported with.
+// Either is 0 if the device does not have it.
+struct DeviceId {
+  int64_t persistent;
+  int64_t topological;
+};
+
+// One device seen since the registry started, with the IDs used to
+// recognise it if it returns
+struct DeviceEntry {
+  IDeckLink* deckLink; // NULL while removed
+  DeviceId id;
+};
+
+// Process-wide list of DeckLink devices, shared by every Capture and
+// Playback. Devices present at start are listed in iterator order, then
+// IDeckLinkDiscovery keeps the list up to date as devices are plugged in
+// and removed. Indices are stable - a removed device keeps its index and
+// takes it again when it returns, and new devices are added at the end.
+class DeviceRegistry : public IDeckLinkDeviceNotificationCallback
+{
+public:
+  // The registry, started on first use, or NULL if the DeckLink driver is
+  // not installed. JS thread only.
+  static DeviceRegistry* get();
+
+  // A reference to the device at index, or NULL if none is present there.
+  // Release the device when done with it. Safe on any thread.
+  IDeckLink* acquire(uint32_t index);
+  // Number of indices used, including those of removed devices
+  uint32_t count();
+
+  // Signal notify when devices arrive or are removed, with the changes
+  // collected by takeEvents(). Returns an error message if the driver
+  // cannot report device changes, or NULL.
+  const char* setNotify(uv_async_t* notify);
+  std::vector<DeviceEvent> takeEvents();
+
+  // IDeckLinkDeviceNotificationCallback, called on a driver thread
+  virtual HRESULT DeckLinkDeviceArrived (IDeckLink* deckLinkDevice);
+  virtual HRESULT DeckLinkDeviceRemoved (IDeckLink* deckLinkDevice);
+
+  // IUnknown - the registry lives for the life of the process
+  HRESULT QueryInterface (REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+  ULONG AddRef () { return 1; }
+  ULONG Release () { return 1; }
+
+private:
+  DeviceRegistry();
+  virtual ~DeviceRegistry() {}
+
+  bool start();
+  // Index of the entry for a device, or -1. Called with padlock held.
+  int findLocked(IDeckLink* deckLink, const DeviceId& id);
+  void notify(uint32_t index, bool arrived);
+
+  std::vector<DeviceEntry> entries_;
+  std::vector<DeviceEvent> events_;
+  IDeckLinkDiscovery* discovery_;
+  const char* discoveryError_; // set by start if discovery_ is NULL
+  uv_async_t* notify_;
+  uv_mutex_t padlock;
+};
+
+} // namespace streampunk
+
+#endif
@@ -0,0 +1,204 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "DeviceStatus.h"
+
+namespace streampunk {
+
+#ifdef WIN32
+typedef BOOL DeckLinkFlag;
+#else
+typedef bool DeckLinkFlag;
+#endif
+
+static const StatusValue statusItems[] = {
+  { bmdDeckLinkStatusDetectedVideoInputMode, "detectedVideoInputMode", false, false, 0 },
+  { bmdDeckLinkStatusDetectedVideoInputFlags, "detectedVideoInputFlags", false, false, 0 },
+  { bmdDeckLinkStatusCurrentVideoInputMode, "currentVideoInputMode", false, false, 0 },
+  { bmdDeckLinkStatusCurrentVideoInputPixelFormat, "currentVideoInputPixelFormat", false, false, 0 },
+  { bmdDeckLinkStatusCurrentVideoInputFlags, "currentVideoInputFlags", false, false, 0 },
+  { bmdDeckLinkStatusCurrentVideoOutputMode, "currentVideoOutputMode", false, false, 0 },
+  { bmdDeckLinkStatusCurrentVideoOutputFlags, "currentVideoOutputFlags", false, false, 0 },
+  { bmdDeckLinkStatusPCIExpressLinkWidth, "pciExpressLinkWidth", false, false, 0 },
+  { bmdDeckLinkStatusPCIExpressLinkSpeed, "pciExpressLinkSpeed", false, false, 0 },
+  { bmdDeckLinkStatusLastVideoOutputPixelFormat, "lastVideoOutputPixelFormat", false, false, 0 },
+  { bmdDeckLinkStatusReferenceSignalMode, "referenceSignalMode", false, false, 0 },
+  { bmdDeckLinkStatusReferenceSignalFlags, "referenceSignalFlags", false, false, 0 },
+  { bmdDeckLinkStatusDuplexMode, "duplexMode", false, false, 0 },
+  { bmdDeckLinkStatusBusy, "busy", false, false, 0 },
+  { bmdDeckLinkStatusInterchangeablePanelType, "interchangeablePanelType", false, false, 0 },
+  { bmdDeckLinkStatusVideoInputSignalLocked, "videoInputSignalLocked", true, false, 0 },
+  { bmdDeckLinkStatusReferenceSignalLocked, "referenceSignalLocked", true, false, 0 },
+  { bmdDeckLinkStatusReceivedEDID, "receivedEDID", true, false, 0 }
+};
+
+// Indexed by device, with NULL for devices not watched. JS thread only.
+static std::vector<DeviceStatus*> watched;
+
+// Changes from every device waiting for JS, guarded by changeLock
+static uv_mutex_t changeLock;
+static bool changeLockReady = false;
+static std::vector<StatusChange> changes;
+static uv_async_t* changeNotify = NULL;
+
+static void initChanges() {
+  if (!changeLockReady) {
+    uv_mutex_init(&changeLock);
+    changeLockReady = true;
+  }
+}
+
+DeviceStatus* DeviceStatus::watch(uint32_t deviceIndex, IDeckLink* deckLink,
+    const char** error) {
+  *error = NULL;
+  if ((deviceIndex < watched.size()) && (watched[deviceIndex] != NULL))
+    return watched[deviceIndex];
+
+  IDeckLinkStatus* status = NULL;
+  IDeckLinkNotification* notification = NULL;
+  if (deckLink->QueryInterface(IID_IDeckLinkStatus, (void**) &status) != S_OK)
+    return NULL;
+  if (deckLink->QueryInterface(IID_IDeckLinkNotification, (void**) &notification) != S_OK) {
+    status->Release();
+    return NULL;
+  }
+  initChanges();
+  DeviceStatus* deviceStatus = new DeviceStatus(deviceIndex, status, notification);
+  if (notification->Subscribe(bmdStatusChanged, deviceStatus) != S_OK) {
+    // Values that would never be updated are worse than none
+    *error = "Failed to subscribe to device status changes.";
+    deviceStatus->Release(); // Releases the interfaces too
+    return NULL;
+  }
+  if (deviceIndex >= watched.size())
+    watched.resize(deviceIndex + 1, NULL);
+  watched[deviceIndex] = deviceStatus;
+  return deviceStatus;
+}
+
+void DeviceStatus::unwatch(uint32_t deviceIndex) {
+  if ((deviceIndex >= watched.size()) || (watched[deviceIndex] == NULL))
+    return;
+  DeviceStatus* deviceStatus = watched[deviceIndex];
+  watched[deviceIndex] = NULL;
+  deviceStatus->notification_->Unsubscribe(bmdStatusChanged, deviceStatus);
+  deviceStatus->Release();
+}
+
+void DeviceStatus::setNotify(uv_async_t* notify) {
+  initChanges();
+  uv_mutex_lock(&changeLock);
+  changeNotify = notify;
+  uv_mutex_unlock(&changeLock);
+}
+
+std::vector<StatusChange> DeviceStatus::takeChanges() {
+  std::vector<StatusChange> taken;
+  if (!changeLockReady) return taken;
+  uv_mutex_lock(&changeLock);
+  taken.swap(changes);
+  uv_mutex_unlock(&changeLock);
+  return taken;
+}
+
+DeviceStatus::DeviceStatus(uint32_t deviceIndex, IDeckLinkStatus* status,
+    IDeckLinkNotification* notification) : refCount_(1), deviceIndex_(deviceIndex),
+    status_(status), notification_(notification),
+    values_(statusItems, statusItems + sizeof(statusItems) / sizeof(statusItems[0])) {
+  uv_mutex_init(&padlock);
+  uv_mutex_lock(&padlock);
+  for ( auto& item : values_ )
+    readLocked(item);
+  uv_mutex_unlock(&padlock);
+}
+
+DeviceStatus::~DeviceStatus() {
+  status_->Release();
+  notification_->Release();
+  uv_mutex_destroy(&padlock);
+}
+
+ULONG DeviceStatus::AddRef() {
+  return ++refCount_;
+}
+
+ULONG DeviceStatus::Release() {
+  ULONG count = --refCount_;
+  if (count == 0)
+    delete this;
+  return count;
+}
+
+std::vector<StatusValue> DeviceStatus::values() {
+  uv_mutex_lock(&padlock);
+  std::vector<StatusValue> result = values_;
+  uv_mutex_unlock(&padlock);
+  return result;
+}
+
+bool DeviceStatus::readLocked(StatusValue& item) {
+  int64_t value = 0;
+  bool known;
+  if (item.flag) {
+    DeckLinkFlag flag;
+    known = status_->GetFlag(item.id, &flag) == S_OK;
+    value = (known && flag) ? 1 : 0;
+  } else {
+    known = status_->GetInt(item.id, &value) == S_OK;
+    if (!known) value = 0;
+  }
+  bool changed = (known != item.known) || (value != item.value);
+  item.known = known;
+  item.value = value;
+  return changed;
+}
+
+HRESULT DeviceStatus::Notify(BMDNotifications topic, uint64_t param1, uint64_t param2) {
+  if (topic != bmdStatusChanged) return S_OK;
+  StatusChange change = { deviceIndex_, NULL, false, false, 0 };
+  uv_mutex_lock(&padlock);
+  for ( auto& item : values_ ) {
+    if (item.id != (BMDDeckLinkStatusID) param1) continue;
+    if (readLocked(item)) {
+      change.name = item.name;
+      change.flag = item.flag;
+      change.known = item.known;
+      change.value = item.value;
+    }
+    break;
+  }
+  uv_mutex_unlock(&padlock);
+  if (change.name == NULL) return S_OK; // Not an item we keep, or no change
+
+  // Merge with a change to the same item still waiting for JS
+  uv_mutex_lock(&changeLock);
+  bool merged = false;
+  for ( auto& pending : changes ) {
+    if ((pending.deviceIndex == change.deviceIndex) && (pending.name == change.name)) {
+      pending = change;
+      merged = true;
+      break;
+    }
+  }
+  if (!merged) {
+    changes.push_back(change);
+    if (changeNotify != NULL)
+      uv_async_send(changeNotify);
+  }
+  uv_mutex_unlock(&changeLock);
+  return S_OK;
+}
+
+} // namespace streampunk
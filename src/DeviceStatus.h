@@ -0,0 +1,96 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef DEVICESTATUS_H
+#define DEVICESTATUS_H
+
+#include <uv.h>
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+namespace streampunk {
+
+// One status item of a device. known is false until the device reports it.
+struct StatusValue {
+  BMDDeckLinkStatusID id;
+  const char* name;
+  bool flag;
+  bool known;
+  int64_t value;
+};
+
+// A status item that has changed since changes were last taken. known is
+// false if the device has stopped reporting it.
+struct StatusChange {
+  uint32_t deviceIndex;
+  const char* name;
+  bool flag;
+  bool known;
+  int64_t value;
+};
+
+// Cache of the IDeckLinkStatus items of one device, kept up to date from
+// bmdStatusChanged notifications rather than by polling. Changes to every
+// watched device are collected in one list and signalled on one async
+// handle, with repeated changes to an item between signals merged.
+class DeviceStatus : public IDeckLinkNotificationCallback
+{
+public:
+  // Status of a device, subscribing to its notifications the first time.
+  // NULL if the device has no status interface, or with error set if it
+  // cannot be watched for changes. JS thread only.
+  static DeviceStatus* watch(uint32_t deviceIndex, IDeckLink* deckLink,
+    const char** error);
+  // Stop watching a device that has been removed. JS thread only.
+  static void unwatch(uint32_t deviceIndex);
+  // Signal notify when statuses change, with the changes collected by
+  // takeChanges(). JS thread only.
+  static void setNotify(uv_async_t* notify);
+  static std::vector<StatusChange> takeChanges();
+
+  // Snapshot of the cached values. Safe on any thread.
+  std::vector<StatusValue> values();
+
+  // IDeckLinkNotificationCallback, called on a driver thread
+  virtual HRESULT Notify (BMDNotifications topic, uint64_t param1, uint64_t param2);
+
+  // IUnknown
+  HRESULT QueryInterface (REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+  ULONG AddRef ();
+  ULONG Release ();
+
+private:
+  DeviceStatus(uint32_t deviceIndex, IDeckLinkStatus* status,
+    IDeckLinkNotification* notification);
+  virtual ~DeviceStatus();
+
+  // Read an item from the device into the cache, returning true if it has
+  // changed. Called with padlock held.
+  bool readLocked(StatusValue& item);
+
+  std::atomic<ULONG> refCount_;
+  uint32_t deviceIndex_;
+  IDeckLinkStatus* status_;
+  IDeckLinkNotification* notification_;
+  std::vector<StatusValue> values_;
+  uv_mutex_t padlock;
+};
+
+} // namespace streampunk
+
+#endif
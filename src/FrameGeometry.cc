@@ -0,0 +1,77 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "FrameGeometry.h"
+#include "Convert.h"
+#include "DeckLinkAPI.h"
+#include <string.h>
+
+namespace streampunk {
+
+// Row padding follows the DeckLink SDK: v210 rows are whole 128 byte blocks
+// of 48 pixels and 10-bit RGB rows are whole 256 byte blocks of 64 pixels.
+static const PixelLayout layouts[] = {
+  { bmdFormat8BitYUV, 2, 4, 2 },
+  { bmdFormat10BitYUV, 6, 16, 48 },
+  { bmdFormat8BitARGB, 1, 4, 1 },
+  { bmdFormat8BitBGRA, 1, 4, 1 },
+  { bmdFormat10BitRGB, 1, 4, 64 },
+  { bmdFormat12BitRGB, 8, 36, 8 },
+  { bmdFormat12BitRGBLE, 8, 36, 8 },
+  { bmdFormat10BitRGBXLE, 1, 4, 64 },
+  { bmdFormat10BitRGBX, 1, 4, 64 },
+  { convertFormatYUV10, 6, 16, 6 }
+};
+
+const PixelLayout* pixelLayout(uint32_t format) {
+  for ( size_t x = 0 ; x < sizeof(layouts) / sizeof(layouts[0]) ; x++ )
+    if (layouts[x].format == format) return &layouts[x];
+  return NULL;
+}
+
+static long groupBytesFor(const PixelLayout* layout, long pixels) {
+  return (pixels + layout->groupPixels - 1) / layout->groupPixels * layout->groupBytes;
+}
+
+FrameGeometry::FrameGeometry(uint32_t format, long width, long height) :
+    format(format), width(width), height(height), rowBytes(0), packedRowBytes(0) {
+  const PixelLayout* layout = pixelLayout(format);
+  if ((layout == NULL) || (width <= 0) || (height <= 0)) return;
+  long padded = (width + layout->rowPixels - 1) / layout->rowPixels * layout->rowPixels;
+  rowBytes = groupBytesFor(layout, padded);
+  packedRowBytes = groupBytesFor(layout, width);
+}
+
+long FrameGeometry::strideFor(size_t length) const {
+  if (!valid()) return 0;
+  if (length >= frameBytes()) return rowBytes;
+  if (length >= packedFrameBytes()) return packedRowBytes;
+  return 0;
+}
+
+void copyRows(const char* src, long srcRowBytes, char* dst, long dstRowBytes,
+    long bytes, long rows) {
+  if ((srcRowBytes == dstRowBytes) && (bytes == dstRowBytes)) {
+    memcpy(dst, src, (size_t) bytes * rows);
+    return;
+  }
+  for ( long y = 0 ; y < rows ; y++ ) {
+    memcpy(dst + y * dstRowBytes, src + y * srcRowBytes, bytes);
+    if (dstRowBytes > bytes)
+      memset(dst + y * dstRowBytes + bytes, 0, dstRowBytes - bytes);
+  }
+}
+
+} // namespace streampunk
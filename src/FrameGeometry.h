@@ -0,0 +1,64 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRAMEGEOMETRY_H
+#define FRAMEGEOMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace streampunk {
+
+// How a pixel format lays out a row: whole groups of pixels, with rows padded
+// to a multiple of rowPixels pixels, as the card pads them.
+struct PixelLayout {
+  uint32_t format;
+  long groupPixels;
+  long groupBytes;
+  long rowPixels;
+};
+
+// The layout of a DeckLink pixel format or a format that can be converted to
+// one, or NULL for an unknown format.
+const PixelLayout* pixelLayout(uint32_t format);
+
+// Row and frame sizes for frames of one pixel format and size. rowBytes is
+// zero for an unknown format.
+struct FrameGeometry {
+  FrameGeometry(uint32_t format, long width, long height);
+
+  bool valid() const { return rowBytes > 0; }
+  size_t frameBytes() const { return (size_t) rowBytes * height; }
+  size_t packedFrameBytes() const { return (size_t) packedRowBytes * height; }
+  // Row stride of frame data of length bytes - rowBytes if it holds a whole
+  // frame of padded rows, otherwise packedRowBytes if it holds a whole frame
+  // of unpadded rows, otherwise zero.
+  long strideFor(size_t length) const;
+
+  uint32_t format;
+  long width;
+  long height;
+  long rowBytes;       // padded as the card pads rows
+  long packedRowBytes; // whole groups of pixels only
+};
+
+// Copy bytes from each of rows rows between buffers with different strides,
+// clearing the rest of each destination row.
+void copyRows(const char* src, long srcRowBytes, char* dst, long dstRowBytes,
+  long bytes, long rows);
+
+} // namespace streampunk
+
+#endif
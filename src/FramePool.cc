@@ -0,0 +1,221 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "FramePool.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace streampunk {
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static size_t pageSize() {
+  #ifdef WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+  #else
+  return (size_t) sysconf(_SC_PAGESIZE);
+  #endif
+}
+
+static size_t roundUp(size_t bytes, size_t boundary) {
+  return (bytes + boundary - 1) / boundary * boundary;
+}
+
+FramePool::FramePool(uint32_t slotCount, bool hugePages) :
+    refCount_(1), slots_(slotCount), hugePages_(hugePages) {
+  uv_mutex_init(&padlock);
+  for ( uint32_t x = 0 ; x < slotCount ; x++ ) {
+    FramePoolSlot* slot = &slots_[x];
+    slot->pool = this;
+    slot->data = NULL;
+    slot->bytes = 0;
+    slot->mapped = 0;
+    slot->refs = 0;
+    slot->huge = false;
+  }
+}
+
+FramePool::~FramePool() {
+  for ( auto& slot : slots_ )
+    unmapSlot(&slot);
+  uv_mutex_destroy(&padlock);
+}
+
+ULONG FramePool::AddRef() {
+  return ++refCount_;
+}
+
+ULONG FramePool::Release() {
+  ULONG count = --refCount_;
+  if (count == 0)
+    delete this;
+  return count;
+}
+
+bool FramePool::mapSlot(FramePoolSlot* slot, size_t bytes) {
+  void* data = NULL;
+  #ifdef WIN32
+  slot->mapped = roundUp(bytes, pageSize());
+  data = VirtualAlloc(NULL, slot->mapped, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  slot->huge = false;
+  #else
+  #ifdef MAP_HUGETLB
+  if (hugePages_) {
+    slot->mapped = roundUp(bytes, HUGE_PAGE_SIZE);
+    data = mmap(NULL, slot->mapped, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data == MAP_FAILED) data = NULL;
+    slot->huge = (data != NULL);
+  }
+  #endif
+  if (data == NULL) { // No reserved huge pages, or not asked for them
+    slot->mapped = roundUp(bytes, pageSize());
+    data = mmap(NULL, slot->mapped, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) data = NULL;
+    slot->huge = false;
+    #ifdef MADV_HUGEPAGE
+    if ((data != NULL) && hugePages_)
+      madvise(data, slot->mapped, MADV_HUGEPAGE);
+    #endif
+  }
+  #endif
+  if (data == NULL) {
+    slot->mapped = 0;
+    return false;
+  }
+  slot->data = (char*) data;
+  slot->bytes = bytes;
+  return true;
+}
+
+void FramePool::unmapSlot(FramePoolSlot* slot) {
+  if (slot->data == NULL) return;
+  #ifdef WIN32
+  VirtualFree(slot->data, 0, MEM_RELEASE);
+  #else
+  munmap(slot->data, slot->mapped);
+  #endif
+  slot->data = NULL;
+  slot->bytes = 0;
+  slot->mapped = 0;
+}
+
+FramePoolSlot* FramePool::findSlot(void* buffer) {
+  char* address = (char*) buffer;
+  for ( auto& slot : slots_ ) {
+    if ((slot.data != NULL) && (address >= slot.data) &&
+        (address < slot.data + slot.bytes))
+      return &slot;
+  }
+  return NULL;
+}
+
+HRESULT FramePool::AllocateBuffer(uint32_t bufferSize, void **allocatedBuffer) {
+  FramePoolSlot* unmapped = NULL;
+  FramePoolSlot* tooSmall = NULL;
+  HRESULT result = E_OUTOFMEMORY;
+  uv_mutex_lock(&padlock);
+  for ( auto& slot : slots_ ) {
+    if (slot.refs > 0) continue;
+    if (slot.data == NULL) {
+      if (unmapped == NULL) unmapped = &slot;
+    } else if (slot.mapped < bufferSize) {
+      if (tooSmall == NULL) tooSmall = &slot;
+    } else { // Recycle a free buffer that is already mapped
+      slot.bytes = bufferSize;
+      slot.refs = 1;
+      *allocatedBuffer = slot.data;
+      uv_mutex_unlock(&padlock);
+      return S_OK;
+    }
+  }
+  FramePoolSlot* slot = (unmapped != NULL) ? unmapped : tooSmall;
+  if (slot != NULL) {
+    unmapSlot(slot);
+    if (mapSlot(slot, bufferSize)) {
+      slot->refs = 1;
+      *allocatedBuffer = slot->data;
+      result = S_OK;
+    }
+  }
+  uv_mutex_unlock(&padlock);
+  return result;
+}
+
+HRESULT FramePool::ReleaseBuffer(void *buffer) {
+  HRESULT result = E_INVALIDARG;
+  uv_mutex_lock(&padlock);
+  FramePoolSlot* slot = findSlot(buffer);
+  if ((slot != NULL) && (slot->refs > 0)) {
+    slot->refs--;
+    result = S_OK;
+  }
+  uv_mutex_unlock(&padlock);
+  return result;
+}
+
+HRESULT FramePool::Commit() {
+  return S_OK;
+}
+
+HRESULT FramePool::Decommit() {
+  // Give back memory for slots that nobody holds
+  uv_mutex_lock(&padlock);
+  for ( auto& slot : slots_ ) {
+    if (slot.refs == 0)
+      unmapSlot(&slot);
+  }
+  uv_mutex_unlock(&padlock);
+  return S_OK;
+}
+
+FramePoolSlot* FramePool::retain(void* buffer) {
+  uv_mutex_lock(&padlock);
+  FramePoolSlot* slot = findSlot(buffer);
+  if ((slot != NULL) && (slot->refs > 0))
+    slot->refs++;
+  else
+    slot = NULL;
+  uv_mutex_unlock(&padlock);
+  if (slot != NULL) AddRef();
+  return slot;
+}
+
+void FramePool::release(FramePoolSlot* slot) {
+  uv_mutex_lock(&padlock);
+  if (slot->refs > 0) slot->refs--;
+  uv_mutex_unlock(&padlock);
+  Release(); // May delete the pool when the capture has already gone
+}
+
+uint32_t FramePool::slotsInUse() {
+  uint32_t inUse = 0;
+  uv_mutex_lock(&padlock);
+  for ( auto& slot : slots_ ) {
+    if (slot.refs > 0) inUse++;
+  }
+  uv_mutex_unlock(&padlock);
+  return inUse;
+}
+
+} // namespace streampunk
@@ -0,0 +1,84 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <uv.h>
+#include <atomic>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+namespace streampunk {
+
+class FramePool;
+
+// One fixed buffer of the pool. A slot is busy while the driver or JS holds
+// a reference to it.
+struct FramePoolSlot {
+  FramePool* pool;
+  char* data;
+  size_t bytes;   // usable size requested by the driver
+  size_t mapped;  // size of the mapping, rounded up to the page size
+  uint32_t refs;
+  bool huge;
+};
+
+// Recycling page-aligned buffer pool registered with the DeckLink input via
+// SetVideoInputFrameMemoryAllocator. Slots are mapped on first use and kept
+// until the pool is destroyed, so a steady capture does no allocation. JS
+// buffers can wrap slot memory directly by taking a reference with retain().
+class FramePool : public IDeckLinkMemoryAllocator
+{
+public:
+  FramePool(uint32_t slotCount, bool hugePages);
+
+  // Take an extra reference on the slot containing buffer, returning NULL if
+  // the buffer is not from this pool. Each retain also holds the pool alive.
+  FramePoolSlot* retain(void* buffer);
+  // Drop a reference taken by retain().
+  void release(FramePoolSlot* slot);
+
+  uint32_t slotCount() const { return (uint32_t) slots_.size(); }
+  uint32_t slotsInUse();
+
+  // IDeckLinkMemoryAllocator
+  virtual HRESULT AllocateBuffer (uint32_t bufferSize, void **allocatedBuffer);
+  virtual HRESULT ReleaseBuffer (void *buffer);
+  virtual HRESULT Commit ();
+  virtual HRESULT Decommit ();
+
+  // IUnknown
+  HRESULT QueryInterface (REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+  ULONG AddRef ();
+  ULONG Release ();
+
+private:
+  virtual ~FramePool();
+
+  FramePoolSlot* findSlot(void* buffer);
+  bool mapSlot(FramePoolSlot* slot, size_t bytes);
+  void unmapSlot(FramePoolSlot* slot);
+
+  std::atomic<ULONG> refCount_;
+  uv_mutex_t padlock;
+  std::vector<FramePoolSlot> slots_;
+  bool hugePages_;
+};
+
+} // namespace streampunk
+
+#endif
@@ -0,0 +1,151 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ModeCatalogue.h"
+#include "DeviceRegistry.h"
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <comdef.h>
+#endif
+
+namespace streampunk {
+
+static const BMDPixelFormat pixelFormats[] = {
+  bmdFormat8BitYUV, bmdFormat10BitYUV, bmdFormat8BitARGB, bmdFormat8BitBGRA,
+  bmdFormat10BitRGB, bmdFormat12BitRGB, bmdFormat12BitRGBLE,
+  bmdFormat10BitRGBXLE, bmdFormat10BitRGBX
+};
+
+// Indexed by device, with NULL for devices that have not been looked at
+static std::vector<ModeCatalogue*> catalogues;
+
+static std::string modeName(IDeckLinkDisplayMode* displayMode) {
+  #ifdef WIN32
+  BSTR nameBSTR = NULL;
+  if (displayMode->GetName(&nameBSTR) != S_OK) return "";
+  _bstr_t name(nameBSTR, false);
+  return std::string((char*) name);
+  #elif __APPLE__
+  CFStringRef nameCFString = NULL;
+  if (displayMode->GetName(&nameCFString) != S_OK) return "";
+  char name [64];
+  CFStringGetCString(nameCFString, name, sizeof(name), kCFStringEncodingMacRoman);
+  CFRelease(nameCFString);
+  return std::string(name);
+  #else
+  const char* name = NULL;
+  if (displayMode->GetName(&name) != S_OK) return "";
+  std::string result(name);
+  free((void*) name);
+  return result;
+  #endif
+}
+
+void ModeCatalogue::loadAll() {
+  DeviceRegistry* registry = DeviceRegistry::get();
+  if (registry == NULL) return; // No driver installed
+  for ( uint32_t x = 0 ; x < registry->count() ; x++ ) {
+    IDeckLink* deckLink = registry->acquire(x);
+    if (deckLink == NULL) continue;
+    forDevice(x, deckLink);
+    deckLink->Release();
+  }
+}
+
+const ModeCatalogue* ModeCatalogue::forDevice(uint32_t deviceIndex, IDeckLink* deckLink) {
+  if (deviceIndex >= catalogues.size())
+    catalogues.resize(deviceIndex + 1, NULL);
+  if (catalogues[deviceIndex] == NULL)
+    catalogues[deviceIndex] = build(deckLink);
+  return catalogues[deviceIndex];
+}
+
+const ModeCatalogue* ModeCatalogue::device(uint32_t deviceIndex) {
+  return (deviceIndex < catalogues.size()) ? catalogues[deviceIndex] : NULL;
+}
+
+const ModeEntry* ModeCatalogue::find(uint32_t mode) const {
+  std::unordered_map<uint32_t, size_t>::const_iterator found = index_.find(mode);
+  return (found != index_.end()) ? &modes_[found->second] : NULL;
+}
+
+ModeCatalogue* ModeCatalogue::build(IDeckLink* deckLink) {
+  IDeckLinkInput* deckLinkInput = NULL;
+  IDeckLinkOutput* deckLinkOutput = NULL;
+  if (deckLink->QueryInterface(IID_IDeckLinkInput, (void**) &deckLinkInput) != S_OK)
+    deckLinkInput = NULL;
+  if (deckLink->QueryInterface(IID_IDeckLinkOutput, (void**) &deckLinkOutput) != S_OK)
+    deckLinkOutput = NULL;
+  if ((deckLinkInput == NULL) && (deckLinkOutput == NULL))
+    return NULL;
+
+  ModeCatalogue* catalogue = new ModeCatalogue;
+  IDeckLinkDisplayModeIterator* displayModeIterator;
+  if ((deckLinkInput != NULL) &&
+      (deckLinkInput->GetDisplayModeIterator(&displayModeIterator) == S_OK)) {
+    catalogue->addModes(displayModeIterator);
+    displayModeIterator->Release();
+  }
+  if ((deckLinkOutput != NULL) &&
+      (deckLinkOutput->GetDisplayModeIterator(&displayModeIterator) == S_OK)) {
+    catalogue->addModes(displayModeIterator);
+    displayModeIterator->Release();
+  }
+
+  BMDDisplayModeSupport support;
+  for ( auto& entry : catalogue->modes_ ) {
+    for ( auto format : pixelFormats ) {
+      if ((deckLinkInput != NULL) &&
+          (deckLinkInput->DoesSupportVideoMode((BMDDisplayMode) entry.mode, format,
+            bmdVideoInputFlagDefault, &support, NULL) == S_OK) &&
+          (support != bmdDisplayModeNotSupported))
+        entry.inputFormats.push_back(format);
+      if ((deckLinkOutput != NULL) &&
+          (deckLinkOutput->DoesSupportVideoMode((BMDDisplayMode) entry.mode, format,
+            bmdVideoOutputFlagDefault, &support, NULL) == S_OK) &&
+          (support != bmdDisplayModeNotSupported))
+        entry.outputFormats.push_back(format);
+    }
+  }
+
+  if (deckLinkInput != NULL) deckLinkInput->Release();
+  if (deckLinkOutput != NULL) deckLinkOutput->Release();
+  return catalogue;
+}
+
+// Add the modes not already seen, as input and output list most of the same
+// modes
+void ModeCatalogue::addModes(IDeckLinkDisplayModeIterator* iterator) {
+  IDeckLinkDisplayMode* displayMode;
+  while (iterator->Next(&displayMode) == S_OK) {
+    uint32_t mode = (uint32_t) displayMode->GetDisplayMode();
+    if (index_.find(mode) == index_.end()) {
+      ModeEntry entry;
+      entry.mode = mode;
+      entry.name = modeName(displayMode);
+      entry.width = displayMode->GetWidth();
+      entry.height = displayMode->GetHeight();
+      displayMode->GetFrameRate(&entry.frameDuration, &entry.timeScale);
+      entry.fieldDominance = displayMode->GetFieldDominance();
+      entry.flags = displayMode->GetFlags();
+      index_[mode] = modes_.size();
+      modes_.push_back(entry);
+    }
+    displayMode->Release();
+  }
+}
+
+} // namespace streampunk
@@ -0,0 +1,72 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef MODECATALOGUE_H
+#define MODECATALOGUE_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+namespace streampunk {
+
+// One display mode of a device, with the pixel formats it can be captured
+// and played in.
+struct ModeEntry {
+  uint32_t mode;
+  std::string name;
+  long width;
+  long height;
+  BMDTimeValue frameDuration;
+  BMDTimeScale timeScale;
+  BMDFieldDominance fieldDominance;
+  BMDDisplayModeFlags flags;
+  std::vector<uint32_t> inputFormats;
+  std::vector<uint32_t> outputFormats;
+};
+
+// Display modes of one device, read from its display mode iterators once and
+// kept for the life of the process, so that looking up a mode is a hash
+// lookup rather than a walk of the iterator with calls into the driver.
+class ModeCatalogue
+{
+public:
+  // Build the catalogues of every device present. Called as the module loads.
+  static void loadAll();
+  // Catalogue of a device, built from deckLink if it was not present at load.
+  // NULL if the device has neither input nor output. JS thread only.
+  static const ModeCatalogue* forDevice(uint32_t deviceIndex, IDeckLink* deckLink);
+  // Catalogue of a device loaded earlier, or NULL. JS thread only.
+  static const ModeCatalogue* device(uint32_t deviceIndex);
+
+  // The mode, or NULL if the device does not have it
+  const ModeEntry* find(uint32_t mode) const;
+  const std::vector<ModeEntry>& modes() const { return modes_; }
+
+private:
+  ModeCatalogue() {}
+  static ModeCatalogue* build(IDeckLink* deckLink);
+  void addModes(IDeckLinkDisplayModeIterator* iterator);
+
+  std::vector<ModeEntry> modes_;
+  std::unordered_map<uint32_t, size_t> index_;
+};
+
+} // namespace streampunk
+
+#endif
@@ -41,6 +41,11 @@
  */
 
 #include "Playback.h"
+#include "Capture.h"
+#include "Convert.h"
+#include "FrameGeometry.h"
+#include "ModeCatalogue.h"
+#include "DeviceRegistry.h"
 #include <string.h>
 
 namespace streampunk {
@@ -50,18 +55,101 @@ inline Nan::Persistent<v8::Function> &Playback::constructor() {
   return myConstructor;
 }
 
+inline Nan::Persistent<v8::FunctionTemplate> &Playback::prototype() {
+  static Nan::Persistent<v8::FunctionTemplate> myPrototype;
+  return myPrototype;
+}
+
 Playback::Playback(uint32_t deviceIndex, uint32_t displayMode,
-    uint32_t pixelFormat) : m_totalFrameScheduled(0), deviceIndex_(deviceIndex),
-    displayMode_(displayMode), pixelFormat_(pixelFormat), result_(0) {
+    uint32_t pixelFormat) : m_deckLink(NULL), m_deckLinkOutput(NULL),
+    m_videoFrames(NULL), m_videoFrameHolds(NULL), m_videoFrameCount(0),
+    m_nextFrameIndex(0), m_totalFrameScheduled(0), deviceIndex_(deviceIndex),
+    displayMode_(displayMode), pixelFormat_(pixelFormat), inputFormat_(pixelFormat),
+    completions_(PLAYBACK_COMPLETION_DEPTH), completionSequence_(0),
+    zeroCopy_(false), reclaimer_(new FrameReclaimer), schedulerEnabled_(false),
+    schedulerDepth_(0), schedulerRepeat_(true), lastFrame_(NULL), blackFrame_(NULL),
+    pendingFillers_(0), jobThreadRunning_(false), jobThreadStopping_(false),
+    audioRing_(NULL), audioTarget_(0), audioLow_(false), source_(NULL),
+    sequenceEnded_(false), sequenceRestoreEnabled_(false), sequenceRestoreDepth_(0), playing_(false), linkCapture_(NULL), linked_(false), linkPreroll_(0), linkStartPending_(false),
+    linkAudio_(false), linkSync_(false), linkDelay_(0), linkSynced_(false), linkStarted_(false) {
   async = new uv_async_t;
-  uv_async_init(uv_default_loop(), async, FrameCallback);
-  uv_mutex_init(&padlock);
+  uv_async_init(uv_default_loop(), async, FrameCallback);
+  uv_mutex_init(&padlock);
   async->data = this;
+  underrunAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), underrunAsync, UnderrunCallback);
+  underrunAsync->data = this;
+  uv_mutex_init(&jobLock);
+  uv_cond_init(&jobReady);
+  uv_mutex_init(&linkLock);
+  jobAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), jobAsync, JobCallback);
+  jobAsync->data = this;
+  audioAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), audioAsync, AudioCallback);
+  audioAsync->data = this;
+  sequenceAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), sequenceAsync, SequenceCallback);
+  sequenceAsync->data = this;
+  linkAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), linkAsync, LinkCallback);
+  linkAsync->data = this;
+}
+
+// Close callback for handles owned by a playback, freed once libuv is done
+static void freeAsync(uv_handle_t* handle) {
+  delete (uv_async_t*) handle;
 }
 
 Playback::~Playback() {
+  stopJobThread();
+  // Stop the output and clear its callbacks, so that no card thread can
+  // reach this object or send to its handles once they are closed
+  if (m_deckLinkOutput != NULL)
+    cleanupDeckLinkOutput();
+  releaseSequences(); // Joins their reader threads
+  uv_close((uv_handle_t*) async, freeAsync);
+  uv_close((uv_handle_t*) sequenceAsync, freeAsync);
+  uv_close((uv_handle_t*) linkAsync, freeAsync);
+  uv_close((uv_handle_t*) underrunAsync, freeAsync);
+  // No further job callbacks can reach this object once the handle is
+  // closed. Jobs finished since the last callback are discarded with it.
+  uv_close((uv_handle_t*) jobAsync, freeAsync);
+  // Frames still on the card keep the reclaimer until they are released
+  reclaimer_->release();
+  for ( auto job : jobsDone_ ) {
+    job->resolver.Reset();
+    job->video.Reset();
+    job->audio.Reset();
+    delete job;
+  }
+  jobsDone_.clear();
   if (!playbackCB_.IsEmpty())
     playbackCB_.Reset();
+  if (!underrunCB_.IsEmpty())
+    underrunCB_.Reset();
+  if (!audioCB_.IsEmpty())
+    audioCB_.Reset();
+  if (!sequenceCB_.IsEmpty())
+    sequenceCB_.Reset();
+  // The card must stop asking for audio before the ring it reads is freed
+  if ((audioRing_ != NULL) && (m_deckLinkOutput != NULL))
+    m_deckLinkOutput->SetAudioCallback(NULL);
+  uv_close((uv_handle_t*) audioAsync, freeAsync);
+  if (audioRing_ != NULL)
+    delete audioRing_;
+  releaseDeckLink();
+}
+
+void Playback::releaseDeckLink() {
+  if (m_deckLinkOutput != NULL) {
+    m_deckLinkOutput->Release();
+    m_deckLinkOutput = NULL;
+  }
+  if (m_deckLink != NULL) {
+    m_deckLink->Release();
+    m_deckLink = NULL;
+  }
 }
 
 NAN_MODULE_INIT(Playback::Init) {
@@ -82,11 +170,20 @@ NAN_MODULE_INIT(Playback::Init) {
   // Prototype
   Nan::SetPrototypeMethod(tpl, "init", BMInit);
   Nan::SetPrototypeMethod(tpl, "scheduleFrame", ScheduleFrame);
+  Nan::SetPrototypeMethod(tpl, "scheduleFrameAsync", ScheduleFrameAsync);
+  Nan::SetPrototypeMethod(tpl, "scheduleFrames", ScheduleFrames);
+  Nan::SetPrototypeMethod(tpl, "writeAudio", WriteAudio);
+  Nan::SetPrototypeMethod(tpl, "playSequence", PlaySequence);
   Nan::SetPrototypeMethod(tpl, "doPlayback", DoPlayback);
   Nan::SetPrototypeMethod(tpl, "stop", StopPlayback);
   Nan::SetPrototypeMethod(tpl, "enableAudio", EnableAudio);
   Nan::SetPrototypeMethod(tpl, "testStuff", TestStuff);
+  Nan::SetPrototypeMethod(tpl, "getStats", GetStats);
+  Nan::SetPrototypeMethod(tpl, "enableZeroCopy", EnableZeroCopy);
+  Nan::SetPrototypeMethod(tpl, "setInputFormat", SetInputFormat);
+  Nan::SetPrototypeMethod(tpl, "enableScheduler", EnableScheduler);
 
+  prototype().Reset(tpl);
   constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
   Nan::Set(target, Nan::New("Playback").ToLocalChecked(),
                Nan::GetFunction(tpl).ToLocalChecked());
@@ -110,35 +207,34 @@ NAN_METHOD(Playback::New) {
   }
 }
 
+Playback* Playback::fromObject(v8::Local<v8::Value> value) {
+  if (!value->IsObject() || !Nan::New(prototype())->HasInstance(value))
+    return NULL;
+  return ObjectWrap::Unwrap<Playback>(Nan::To<v8::Object>(value).ToLocalChecked());
+}
+
 NAN_METHOD(Playback::BMInit) {
-  IDeckLinkIterator* deckLinkIterator;
-  HRESULT	result;
-  IDeckLinkAPIInformation *deckLinkAPIInformation;
-  IDeckLink* deckLink;
-  #ifdef WIN32
-  CoCreateInstance(CLSID_CDeckLinkIterator, NULL, CLSCTX_ALL, IID_IDeckLinkIterator, (void**)&deckLinkIterator);
-  #else
-  deckLinkIterator = CreateDeckLinkIteratorInstance();
-  #endif
-  result = deckLinkIterator->QueryInterface(IID_IDeckLinkAPIInformation, (void**)&deckLinkAPIInformation);
-  if (result != S_OK) {
+  DeviceRegistry* registry = DeviceRegistry::get();
+  if (registry == NULL) {
     Nan::ThrowError("Error connecting to DeckLinkAPI.\n");
+    return;
   }
   Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
 
-  for ( uint32_t x = 0 ; x <= obj->deviceIndex_ ; x++ ) {
-    if (deckLinkIterator->Next(&deckLink) != S_OK) {
-      info.GetReturnValue().SetUndefined();
-      return;
-    }
+  IDeckLink* deckLink = registry->acquire(obj->deviceIndex_);
+  if (deckLink == NULL) {
+    info.GetReturnValue().SetUndefined();
+    return;
   }
-
+  obj->unlinkCapture();
+  obj->releaseDeckLink();
   obj->m_deckLink = deckLink;
 
   IDeckLinkOutput *deckLinkOutput;
   if (deckLink->QueryInterface(IID_IDeckLinkOutput, (void **)&deckLinkOutput) != S_OK)
   {
     Nan::ThrowError("Could not obtain DeckLink Output interface.\n");
+    return;
   }
   obj->m_deckLinkOutput = deckLinkOutput;
 
@@ -153,6 +249,14 @@ NAN_METHOD(Playback::DoPlayback) {
   Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
   obj->playbackCB_.Reset(cb);
 
+  if (obj->schedulerEnabled_) {
+    // Preroll up to the scheduler's depth, whatever JS has queued so far
+    uv_mutex_lock(&obj->padlock);
+    obj->topUpFrames();
+    obj->pendingFillers_ = 0; // Not an underrun
+    uv_mutex_unlock(&obj->padlock);
+  }
+
   if (obj->hasAudio_) {
     if (obj->m_deckLinkOutput->EndAudioPreroll() != S_OK)
       printf("Failed to end audio preroll.\n");
@@ -162,6 +266,12 @@ NAN_METHOD(Playback::DoPlayback) {
   // printf("Playback result code %i and timescale %I64d.\n", result, obj->m_timeScale);
 
   if (result == S_OK) {
+    uv_mutex_lock(&obj->padlock);
+    obj->playing_ = true;
+    uv_mutex_unlock(&obj->padlock);
+    uv_mutex_lock(&obj->linkLock);
+    obj->linkPreroll_ = 0;
+    uv_mutex_unlock(&obj->linkLock);
     info.GetReturnValue().Set(Nan::New("Playback started.").ToLocalChecked());
   }
   else {
@@ -185,70 +295,778 @@ NAN_METHOD(Playback::TestStuff) {
   printf("What is its value? %i\n", audObj.IsEmpty());
 }
 
+NAN_METHOD(Playback::GetStats) {
+  Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+
+  uv_mutex_lock(&obj->padlock);
+  uint32_t framesScheduled = obj->m_totalFrameScheduled;
+  uv_mutex_unlock(&obj->padlock);
+  Nan::Set(stats, Nan::New("framesScheduled").ToLocalChecked(),
+    Nan::New<v8::Number>(framesScheduled));
+  Nan::Set(stats, Nan::New("framesCompleted").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesCompleted_.get()));
+  Nan::Set(stats, Nan::New("framesDisplayedLate").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesDisplayedLate_.get()));
+  Nan::Set(stats, Nan::New("framesDropped").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesDropped_.get()));
+  Nan::Set(stats, Nan::New("framesFlushed").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesFlushed_.get()));
+  Nan::Set(stats, Nan::New("completionsLost").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->completionsLost_.get()));
+  Nan::Set(stats, Nan::New("linkFramesShared").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->linkFramesShared_.get()));
+  Nan::Set(stats, Nan::New("linkFramesCopied").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->linkFramesCopied_.get()));
+  Nan::Set(stats, Nan::New("linkFramesFailed").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->linkFramesFailed_.get()));
+  Nan::Set(stats, Nan::New("linkStartFailures").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->linkStartFailures_.get()));
+  Nan::Set(stats, Nan::New("syncFramesDropped").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->syncFramesDropped_.get()));
+  Nan::Set(stats, Nan::New("syncFramesRepeated").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->syncFramesRepeated_.get()));
+  Nan::Set(stats, Nan::New("syncResets").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->syncResets_.get()));
+  if (obj->source_ != NULL) {
+    Nan::Set(stats, Nan::New("sequenceFrames").ToLocalChecked(),
+      Nan::New<v8::Number>((double) obj->sequenceFrames_.get()));
+    Nan::Set(stats, Nan::New("sequenceFramesRead").ToLocalChecked(),
+      Nan::New<v8::Number>((double) obj->source_->framesRead()));
+    Nan::Set(stats, Nan::New("sequenceReadErrors").ToLocalChecked(),
+      Nan::New<v8::Number>((double) obj->source_->readErrors()));
+  }
+  if (obj->audioRing_ != NULL) {
+    Nan::Set(stats, Nan::New("audioRingSamples").ToLocalChecked(),
+      Nan::New<v8::Number>((double) (obj->audioRing_->size() / obj->sampleByteFactor_)));
+    Nan::Set(stats, Nan::New("audioUnderruns").ToLocalChecked(),
+      Nan::New<v8::Number>((double) obj->audioUnderruns_.get()));
+  }
+  Nan::Set(stats, Nan::New("underruns").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->underruns_.get()));
+  Nan::Set(stats, Nan::New("framesRepeated").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesRepeated_.get()));
+  Nan::Set(stats, Nan::New("framesBlack").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesBlack_.get()));
+  Nan::Set(stats, Nan::New("asyncWakeups").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->asyncWakeups_.get()));
+  Nan::Set(stats, Nan::New("audioSamplesDropped").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->audioSamplesDropped_.get()));
+  Nan::Set(stats, Nan::New("framesWrapped").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesWrapped_.get()));
+  Nan::Set(stats, Nan::New("framesAllocated").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->framesAllocated_.get()));
+
+  uv_mutex_lock(&obj->padlock);
+  uint32_t poolFramesInUse = 0;
+  for ( uint32_t x = 0 ; x < obj->m_videoFrameCount ; x++ ) {
+    if (obj->m_videoFrameHolds[x] > 0) poolFramesInUse++;
+  }
+  uint32_t poolFrames = obj->m_videoFrameCount;
+  uv_mutex_unlock(&obj->padlock);
+  Nan::Set(stats, Nan::New("poolFrames").ToLocalChecked(),
+    Nan::New<v8::Number>(poolFrames));
+  Nan::Set(stats, Nan::New("poolFramesInUse").ToLocalChecked(),
+    Nan::New<v8::Number>(poolFramesInUse));
+  Nan::Set(stats, Nan::New("poolCreateFailures").ToLocalChecked(),
+    Nan::New<v8::Number>((double) obj->poolCreateFailures_.get()));
+
+  if (obj->m_deckLinkOutput != NULL) {
+    uint32_t bufferedFrames = 0;
+    if (obj->m_deckLinkOutput->GetBufferedVideoFrameCount(&bufferedFrames) == S_OK)
+      Nan::Set(stats, Nan::New("bufferedVideoFrames").ToLocalChecked(),
+        Nan::New<v8::Number>(bufferedFrames));
+    uint32_t bufferedSamples = 0;
+    if (obj->hasAudio_ &&
+        (obj->m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&bufferedSamples) == S_OK))
+      Nan::Set(stats, Nan::New("bufferedAudioSamples").ToLocalChecked(),
+        Nan::New<v8::Number>(bufferedSamples));
+  }
+
+  info.GetReturnValue().Set(stats);
+}
+
+NAN_METHOD(Playback::EnableZeroCopy) {
+  Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  obj->zeroCopy_ = info[0]->IsUndefined() ? true : Nan::To<bool>(info[0]).FromJust();
+
+  info.GetReturnValue().Set(Nan::New<v8::String>(obj->zeroCopy_ ?
+    "zero copy enabled" : "zero copy disabled").ToLocalChecked());
+}
+
+NAN_METHOD(Playback::SetInputFormat) {
+  Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  uint32_t format = info[0]->IsNumber() ? Nan::To<uint32_t>(info[0]).FromJust() : obj->pixelFormat_;
+  if (!canConvert(format, obj->pixelFormat_)) {
+    info.GetReturnValue().Set(Nan::New("Cannot convert from that format to the playback format.").ToLocalChecked());
+    return;
+  }
+  obj->inputFormat_ = format;
+  info.GetReturnValue().Set(Nan::New("Input format set.").ToLocalChecked());
+}
+
+NAN_METHOD(Playback::EnableScheduler) {
+  Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  if (!info[2]->IsFunction()) {
+    Nan::ThrowTypeError("Scheduler requires an underrun callback.");
+    return;
+  }
+  uint32_t depth = info[0]->IsNumber() ? Nan::To<uint32_t>(info[0]).FromJust() : 0;
+  if (depth == 0) {
+    info.GetReturnValue().Set(Nan::New("Scheduler depth must be at least one frame.").ToLocalChecked());
+    return;
+  }
+  obj->underrunCB_.Reset(v8::Local<v8::Function>::Cast(info[2]));
+  uv_mutex_lock(&obj->padlock);
+  obj->schedulerDepth_ = depth;
+  obj->schedulerRepeat_ = Nan::To<bool>(info[1]).FromJust();
+  obj->schedulerEnabled_ = true;
+  // Also kept once any sequence playing now has ended
+  obj->sequenceRestoreDepth_ = depth;
+  obj->sequenceRestoreEnabled_ = true;
+  uv_mutex_unlock(&obj->padlock);
+
+  info.GetReturnValue().Set(Nan::New("scheduler enabled").ToLocalChecked());
+}
+
 NAN_METHOD(Playback::ScheduleFrame) {
   Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  if (!node::Buffer::HasInstance(info[0])) {
+    Nan::ThrowTypeError("Frame must be a video buffer.");
+    return;
+  }
   v8::Local<v8::Object> bufObj = Nan::To<v8::Object>(info[0]).ToLocalChecked();
   Nan::MaybeLocal<v8::Object> audBufObj = Nan::MaybeLocal<v8::Object>();
   if (info.Length() >= 2) audBufObj = Nan::To<v8::Object>(info[1]);
   bool processAudio = obj->hasAudio_ && !audBufObj.IsEmpty();
 
-  uint32_t rowBytePixelRatioN = 1, rowBytePixelRatioD = 1;
-  switch (obj->pixelFormat_) { // TODO expand to other pixel formats
-    case bmdFormat10BitYUV:
-      rowBytePixelRatioN = 8; rowBytePixelRatioD = 3;
-      break;
-    default:
-      rowBytePixelRatioN = 2; rowBytePixelRatioD = 1;
+  IDeckLinkVideoFrame* frame = obj->wrapFrame(bufObj);
+  const char* error = NULL;
+  if (frame == NULL)
+    error = obj->copyFrame(node::Buffer::Data(bufObj), node::Buffer::Length(bufObj), &frame);
+  uint32_t scheduled = 0;
+  if (error == NULL)
+    error = obj->scheduleFrame(frame,
+      processAudio ? node::Buffer::Data(audBufObj.ToLocalChecked()) : NULL,
+      processAudio ? node::Buffer::Length(audBufObj.ToLocalChecked()) : 0, &scheduled);
+
+  if (error != NULL)
+    info.GetReturnValue().Set(Nan::New(error).ToLocalChecked());
+  else
+    info.GetReturnValue().Set(scheduled);
+}
+
+NAN_METHOD(Playback::ScheduleFrames) {
+  Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  if (!info[0]->IsArray()) {
+    Nan::ThrowTypeError("Frames must be an array of objects with video and audio buffers.");
+    return;
+  }
+  v8::Local<v8::Array> items = v8::Local<v8::Array>::Cast(info[0]);
+  uint32_t count = items->Length();
+
+  // Copy every frame first, so that the lock is only held to schedule them
+  std::vector<IDeckLinkVideoFrame*> frames;
+  std::vector<v8::Local<v8::Object> > audio;
+  const char* error = NULL;
+  for ( uint32_t x = 0 ; (x < count) && (error == NULL) ; x++ ) {
+    v8::Local<v8::Value> item = Nan::Get(items, x).ToLocalChecked();
+    v8::Local<v8::Value> video;
+    if (item->IsObject())
+      video = Nan::Get(item.As<v8::Object>(), Nan::New("video").ToLocalChecked()).ToLocalChecked();
+    if (video.IsEmpty() || !node::Buffer::HasInstance(video)) {
+      error = "Each frame must have a video buffer.";
       break;
+    }
+    v8::Local<v8::Object> bufObj = video.As<v8::Object>();
+    IDeckLinkVideoFrame* frame = obj->wrapFrame(bufObj);
+    if (frame == NULL)
+      error = obj->copyFrame(node::Buffer::Data(bufObj), node::Buffer::Length(bufObj), &frame);
+    if (error != NULL) break;
+    frames.push_back(frame);
+    v8::Local<v8::Value> aud =
+      Nan::Get(item.As<v8::Object>(), Nan::New("audio").ToLocalChecked()).ToLocalChecked();
+    audio.push_back((obj->hasAudio_ && node::Buffer::HasInstance(aud)) ?
+      aud.As<v8::Object>() : v8::Local<v8::Object>());
+  }
+
+  uv_mutex_lock(&obj->padlock);
+  uint32_t scheduled = obj->m_totalFrameScheduled;
+  for ( size_t x = 0 ; x < frames.size() ; x++ ) {
+    if (error != NULL) { // Give back the frames after a failure
+      obj->dropFrame(frames[x]);
+      continue;
+    }
+    error = obj->scheduleFrameLocked(frames[x],
+      audio[x].IsEmpty() ? NULL : node::Buffer::Data(audio[x]),
+      audio[x].IsEmpty() ? 0 : node::Buffer::Length(audio[x]), &scheduled);
   }
+  uv_mutex_unlock(&obj->padlock);
+
+  if (error != NULL)
+    info.GetReturnValue().Set(Nan::New(error).ToLocalChecked());
+  else
+    info.GetReturnValue().Set(scheduled);
+}
 
-  IDeckLinkMutableVideoFrame* frame;
-  if (obj->m_deckLinkOutput->CreateVideoFrame(obj->m_width, obj->m_height,
-      obj->m_width * rowBytePixelRatioN / rowBytePixelRatioD,
-      (BMDPixelFormat) obj->pixelFormat_, bmdFrameFlagDefault, &frame) != S_OK) {
-    info.GetReturnValue().Set(Nan::New("Failed to create frame.").ToLocalChecked());
+NAN_METHOD(Playback::ScheduleFrameAsync) {
+  Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  if (!node::Buffer::HasInstance(info[0])) {
+    Nan::ThrowTypeError("Frame must be a video buffer.");
     return;
-  };
+  }
+  v8::Local<v8::Object> bufObj = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+  Nan::MaybeLocal<v8::Object> audBufObj = Nan::MaybeLocal<v8::Object>();
+  if (info.Length() >= 2) audBufObj = Nan::To<v8::Object>(info[1]);
+  bool processAudio = obj->hasAudio_ && !audBufObj.IsEmpty();
+
+  v8::Local<v8::Promise::Resolver> resolver =
+    v8::Promise::Resolver::New(Nan::GetCurrentContext()).ToLocalChecked();
+  ScheduleJob* job = new ScheduleJob;
+  job->resolver.Reset(resolver);
+  // The buffers are held until the job is done, so their memory can be
+  // read on the worker thread
+  job->video.Reset(bufObj);
+  job->wrapped = obj->wrapFrame(bufObj);
+  job->videoData = node::Buffer::Data(bufObj);
+  job->videoLength = node::Buffer::Length(bufObj);
+  job->audioData = NULL;
+  job->audioLength = 0;
+  if (processAudio) {
+    job->audio.Reset(audBufObj.ToLocalChecked());
+    job->audioData = node::Buffer::Data(audBufObj.ToLocalChecked());
+    job->audioLength = node::Buffer::Length(audBufObj.ToLocalChecked());
+  }
+  job->error = NULL;
+  job->scheduled = 0;
+
+  if (!obj->jobThreadRunning_) {
+    obj->jobThreadStopping_ = false;
+    if (uv_thread_create(&obj->jobThread_, JobThread, obj) != 0) {
+      if (job->wrapped != NULL) job->wrapped->Release();
+      job->resolver.Reset();
+      job->video.Reset();
+      job->audio.Reset();
+      delete job;
+      Nan::ThrowError("Failed to start playback scheduling thread.");
+      return;
+    }
+    obj->jobThreadRunning_ = true;
+  }
+  uv_mutex_lock(&obj->jobLock);
+  obj->jobs_.push_back(job);
+  uv_cond_signal(&obj->jobReady);
+  uv_mutex_unlock(&obj->jobLock);
+
+  info.GetReturnValue().Set(resolver->GetPromise());
+}
+
+// Jobs are taken one at a time in the order they were queued, so frames are
+// scheduled in the order JS sent them.
+void Playback::JobThread(void* arg) {
+  Playback* playback = static_cast<Playback*>(arg);
+  while (true) {
+    uv_mutex_lock(&playback->jobLock);
+    while (playback->jobs_.empty() && !playback->jobThreadStopping_)
+      uv_cond_wait(&playback->jobReady, &playback->jobLock);
+    if (playback->jobs_.empty()) { // Stopping with nothing left to do
+      uv_mutex_unlock(&playback->jobLock);
+      break;
+    }
+    ScheduleJob* job = playback->jobs_.front();
+    playback->jobs_.pop_front();
+    uv_mutex_unlock(&playback->jobLock);
+
+    IDeckLinkVideoFrame* frame = job->wrapped;
+    if (frame == NULL)
+      job->error = playback->copyFrame(job->videoData, job->videoLength, &frame);
+    if (job->error == NULL)
+      job->error = playback->scheduleFrame(frame, job->audioData, job->audioLength,
+        &job->scheduled);
+
+    uv_mutex_lock(&playback->jobLock);
+    playback->jobsDone_.push_back(job);
+    uv_mutex_unlock(&playback->jobLock);
+    uv_async_send(playback->jobAsync);
+  }
+}
+
+void Playback::stopJobThread() {
+  if (!jobThreadRunning_) return;
+  uv_mutex_lock(&jobLock);
+  jobThreadStopping_ = true;
+  uv_cond_signal(&jobReady);
+  uv_mutex_unlock(&jobLock);
+  uv_thread_join(&jobThread_); // Finishes the jobs already queued
+  jobThreadRunning_ = false;
+}
+
+NAUV_WORK_CB(Playback::JobCallback) {
+  Nan::HandleScope scope;
+  Playback *playback = static_cast<Playback*>(async->data);
+  std::vector<ScheduleJob*> done;
+  uv_mutex_lock(&playback->jobLock);
+  done.swap(playback->jobsDone_);
+  uv_mutex_unlock(&playback->jobLock);
+
+  for ( auto job : done ) {
+    v8::Local<v8::Promise::Resolver> resolver = Nan::New(job->resolver);
+    if (job->error != NULL)
+      resolver->Reject(Nan::GetCurrentContext(), Nan::Error(job->error)).FromJust();
+    else
+      resolver->Resolve(Nan::GetCurrentContext(),
+        Nan::New<v8::Number>(job->scheduled)).FromJust();
+    job->resolver.Reset();
+    job->video.Reset();
+    job->audio.Reset();
+    delete job;
+  }
+}
+
+IDeckLinkVideoFrame* Playback::wrapFrame(v8::Local<v8::Object> bufObj) {
+  long rowBytes = frameRowBytes();
   char* bufData = node::Buffer::Data(bufObj);
   size_t bufLength = node::Buffer::Length(bufObj);
+  if (!zeroCopy_ || (inputFormat_ != pixelFormat_) ||
+      (bufLength < (size_t) (rowBytes * m_height)) ||
+      !BufferFrame::canWrap(bufData))
+    return NULL;
+
+  // Play from the JS buffer itself, holding it until the frame completes
+  framesWrapped_.increment();
+  return new BufferFrame(bufObj, m_width, m_height, rowBytes,
+    (BMDPixelFormat) pixelFormat_, reclaimer_);
+}
+
+const char* Playback::copyFrame(const char* data, size_t length, IDeckLinkVideoFrame** frame) {
+  // Frames from JS may have rows padded as the card pads them or packed with
+  // no padding at all - anything shorter would be played with missing rows
+  FrameGeometry source(inputFormat_, m_width, m_height);
+  long srcRowBytes = source.strideFor(length);
+  if (srcRowBytes == 0)
+    return "Frame buffer is smaller than a frame.";
+  return copyFrameFrom(data, srcRowBytes, inputFormat_, frame);
+}
+
+const char* Playback::copyFrameFrom(const char* data, long srcRowBytes,
+    uint32_t srcFormat, IDeckLinkVideoFrame** frame) {
+  long rowBytes = frameRowBytes();
+  IDeckLinkMutableVideoFrame* copyFrame;
+  int index = acquireFrame();
+  if (index >= 0) {
+    copyFrame = m_videoFrames[index];
+  } else { // Every frame of the ring is still queued on the card
+    if (m_deckLinkOutput->CreateVideoFrame(m_width, m_height, rowBytes,
+        (BMDPixelFormat) pixelFormat_, bmdFrameFlagDefault, &copyFrame) != S_OK)
+      return "Failed to create frame.";
+    uv_mutex_lock(&padlock);
+    framesAllocated_.increment();
+    uv_mutex_unlock(&padlock);
+  }
   char* frameData = NULL;
-  if (frame->GetBytes((void**) &frameData) != S_OK) {
-    info.GetReturnValue().Set(Nan::New("Failed to get new frame bytes.").ToLocalChecked());
-    return;
+  if (copyFrame->GetBytes((void**) &frameData) != S_OK) {
+    uv_mutex_lock(&padlock);
+    dropFrame(copyFrame);
+    uv_mutex_unlock(&padlock);
+    return "Failed to get new frame bytes.";
   };
-  memcpy(frameData, bufData, bufLength);
+  if (srcFormat == pixelFormat_) {
+    // One copy for padded rows, otherwise row by row into the padded frame
+    copyRows(data, srcRowBytes, frameData, rowBytes,
+      (srcRowBytes < rowBytes) ? srcRowBytes : rowBytes, m_height);
+  } else {
+    // Convert as the rows are copied, at little more cost in memory traffic
+    // than the copy alone
+    const char* error = convertFrame(data, srcRowBytes, srcFormat, frameData,
+      rowBytes, pixelFormat_, m_width, m_height);
+    if (error != NULL) {
+      uv_mutex_lock(&padlock);
+      dropFrame(copyFrame);
+      uv_mutex_unlock(&padlock);
+      return error;
+    }
+  }
+  *frame = copyFrame;
+  return NULL;
+}
+
+const char* Playback::scheduleFrame(IDeckLinkVideoFrame* frame, const char* audio,
+    size_t audioLength, uint32_t* scheduled) {
+  uv_mutex_lock(&padlock);
+  const char* error = scheduleFrameLocked(frame, audio, audioLength, scheduled);
+  uv_mutex_unlock(&padlock);
+  return error;
+}
 
-  // printf("Frame duration %I64d/%I64d.\n", obj->m_frameDuration, obj->m_timeScale);
-  uv_mutex_lock(&obj->padlock);
-  HRESULT sfr = obj->m_deckLinkOutput->ScheduleVideoFrame(frame,
-      (obj->m_totalFrameScheduled * obj->m_frameDuration),
-      obj->m_frameDuration, obj->m_timeScale);
+const char* Playback::scheduleFrameLocked(IDeckLinkVideoFrame* frame, const char* audio,
+    size_t audioLength, uint32_t* scheduled) {
+  // printf("Frame duration %I64d/%I64d.\n", m_frameDuration, m_timeScale);
+  HRESULT sfr = m_deckLinkOutput->ScheduleVideoFrame(frame,
+      (m_totalFrameScheduled * m_frameDuration),
+      m_frameDuration, m_timeScale);
   if (sfr != S_OK) {
     printf("Failed to schedule frame. Code is %i.\n", sfr);
-    info.GetReturnValue().Set(Nan::New("Failed to schedule frame.").ToLocalChecked());
-    uv_mutex_unlock(&obj->padlock);
-    return;
+    dropFrame(frame);
+    return "Failed to schedule frame.";
   };
+  m_totalFrameScheduled++;
+  *scheduled = m_totalFrameScheduled;
+  if (schedulerEnabled_ && schedulerRepeat_) {
+    // Keep the newest frame to repeat if JS falls behind
+    holdFrame(frame);
+    if (lastFrame_ != NULL) dropFrame(lastFrame_);
+    lastFrame_ = frame;
+  }
 
-  if (processAudio) {
-    uint32_t sampleFramesWritten = NULL;
-    HRESULT saud = obj->m_deckLinkOutput->ScheduleAudioSamples(
-      node::Buffer::Data(audBufObj.ToLocalChecked()),
-      node::Buffer::Length(audBufObj.ToLocalChecked()) / obj->sampleByteFactor_,
-      obj->m_totalSampleScheduled,
-      obj->audioSampleRate_, &sampleFramesWritten);
-    obj->m_totalSampleScheduled += sampleFramesWritten;
+  if ((audio != NULL) && (audioRing_ != NULL)) {
+    // Pulled audio plays continuously from the ring
+    uint32_t sampleFrameCount = audioLength / sampleByteFactor_;
+    uint32_t sampleFramesWritten = (uint32_t) (audioRing_->write(audio,
+      (size_t) sampleFrameCount * sampleByteFactor_) / sampleByteFactor_);
+    audioSamplesDropped_.increment(sampleFrameCount - sampleFramesWritten);
+  } else if (audio != NULL) {
+    uint32_t sampleFramesWritten = 0;
+    uint32_t sampleFrameCount = audioLength / sampleByteFactor_;
+    HRESULT saud = m_deckLinkOutput->ScheduleAudioSamples(
+      (void*) audio, sampleFrameCount, m_totalSampleScheduled,
+      audioSampleRate_, &sampleFramesWritten);
+    m_totalSampleScheduled += sampleFramesWritten;
+    audioSamplesDropped_.increment(sampleFrameCount - sampleFramesWritten);
     if (saud != S_OK) {
       printf("Failed to schedule audio. Code is %i.\n", saud);
-      info.GetReturnValue().Set(Nan::New("Failed to schedule audio.").ToLocalChecked());
-      uv_mutex_unlock(&obj->padlock);
+      return "Failed to schedule audio.";
+    }
+  }
+
+  return NULL;
+}
+
+const char* Playback::startLink(Capture* capture, uint32_t delay, bool sync,
+    BMDTimeValue frameDuration, BMDTimeScale timeScale, uint32_t sampleByteFactor) {
+  if (m_deckLinkOutput == NULL)
+    return "Playback is not initialised.";
+  if (frameDuration * m_timeScale != m_frameDuration * timeScale)
+    return "Capture and playback frame rates differ.";
+  if (hasAudio_ && (sampleByteFactor != 0) && (sampleByteFactor != sampleByteFactor_))
+    return "Capture and playback audio formats differ.";
+  uv_mutex_lock(&linkLock);
+  if (linked_) {
+    uv_mutex_unlock(&linkLock);
+    return "Playback is already linked.";
+  }
+  uv_mutex_lock(&padlock);
+  bool playing = playing_;
+  uv_mutex_unlock(&padlock);
+  linked_ = true;
+  linkCapture_ = capture;
+  linkAudio_ = hasAudio_ && (sampleByteFactor != 0);
+  linkDelay_ = (delay > 0) ? delay : 1;
+  linkPreroll_ = playing ? 0 : linkDelay_;
+  linkSync_ = sync;
+  linkSynced_ = false;
+  uv_mutex_unlock(&linkLock);
+  return NULL;
+}
+
+void Playback::unlinkCapture() {
+  // The capture calls back to endLink once it has stopped sending frames
+  if (linkCapture_ != NULL)
+    linkCapture_->unlinkPlayback();
+}
+
+void Playback::endLink() {
+  linkCapture_ = NULL;
+  uv_mutex_lock(&linkLock);
+  linked_ = false;
+  linkPreroll_ = 0;
+  linkStartPending_ = false;
+  uv_mutex_unlock(&linkLock);
+}
+
+void Playback::linkFrame(IDeckLinkVideoInputFrame* frame, IDeckLinkAudioInputPacket* audio) {
+  if (frame == NULL)
+    return;
+  uv_mutex_lock(&linkLock);
+  if (!linked_) { // Playback has stopped
+    uv_mutex_unlock(&linkLock);
+    return;
+  }
+  int32_t repeats = 0;
+  if (linkSync_ && (linkPreroll_ == 0)) {
+    uv_mutex_lock(&padlock);
+    repeats = syncLinkLocked(frame);
+    uv_mutex_unlock(&padlock);
+    if (repeats < 0) { // The input is running ahead - drop the frame and its audio
+      syncFramesDropped_.increment();
+      uv_mutex_unlock(&linkLock);
       return;
     }
   }
+  IDeckLinkVideoFrame* output = NULL;
+  if ((frame->GetPixelFormat() == (BMDPixelFormat) pixelFormat_) &&
+      (frame->GetWidth() == m_width) && (frame->GetHeight() == m_height) &&
+      (frame->GetRowBytes() == frameRowBytes())) {
+    // Play the captured frame itself, holding it until it completes
+    frame->AddRef();
+    output = frame;
+    linkFramesShared_.increment();
+  } else {
+    char* data = NULL;
+    const char* error = NULL;
+    if ((frame->GetWidth() != m_width) || (frame->GetHeight() != m_height))
+      error = "Captured frame size does not match playback.";
+    else if ((frame->GetBytes((void**) &data) != S_OK) || (data == NULL))
+      error = "Failed to get captured frame bytes.";
+    else
+      error = copyFrameFrom(data, frame->GetRowBytes(), frame->GetPixelFormat(), &output);
+    if (error != NULL) {
+      linkFramesFailed_.increment();
+      uv_mutex_unlock(&linkLock);
+      return;
+    }
+    linkFramesCopied_.increment();
+  }
 
-  obj->m_totalFrameScheduled++;
-  uv_mutex_unlock(&obj->padlock);
-  info.GetReturnValue().Set(obj->m_totalFrameScheduled);
+  const char* audioData = NULL;
+  size_t audioLength = 0;
+  if (linkAudio_ && (audio != NULL) && (audio->GetBytes((void**) &audioData) == S_OK))
+    audioLength = (size_t) audio->GetSampleFrameCount() * sampleByteFactor_;
+  const char* silence = NULL;
+  size_t silenceLength = 0;
+  if (linkAudio_ && (repeats > 0)) {
+    // Repeats play silence for as long as the frame's own audio, or for the
+    // nominal length of a frame if it had none
+    silenceLength = (audioLength > 0) ? audioLength : (size_t)
+      (audioSampleRate_ * m_frameDuration / m_timeScale) * sampleByteFactor_;
+    if (linkSilence_.size() < silenceLength)
+      linkSilence_.resize(silenceLength, 0);
+    silence = linkSilence_.data();
+  }
+  uint32_t scheduled = 0;
+  uv_mutex_lock(&padlock);
+  for ( int32_t x = 0 ; x < repeats ; x++ ) {
+    holdFrame(output);
+    if (scheduleFrameLocked(output, silence, silenceLength, &scheduled) != NULL)
+      break;
+    syncFramesRepeated_.increment();
+  }
+  if (scheduleFrameLocked(output, audioData, audioLength, &scheduled) != NULL) {
+    linkFramesFailed_.increment();
+  } else if ((linkPreroll_ > 0) && (--linkPreroll_ == 0)) {
+    // Started from the event loop, keeping this thread free for input
+    linkStartPending_ = true;
+    uv_async_send(linkAsync);
+  }
+  uv_mutex_unlock(&padlock);
+  uv_mutex_unlock(&linkLock);
+}
+
+NAUV_WORK_CB(Playback::LinkCallback) {
+  Playback *playback = static_cast<Playback*>(async->data);
+  uv_mutex_lock(&playback->linkLock);
+  bool start = playback->linked_ && playback->linkStartPending_;
+  playback->linkStartPending_ = false;
+  uv_mutex_unlock(&playback->linkLock);
+  if (!start) // Stopped or unlinked since
+    return;
+
+  // Nothing in JS asked for completions, so they are not queued for it
+  playback->linkStarted_ = true;
+  if ((playback->hasAudio_ && (playback->m_deckLinkOutput->EndAudioPreroll() != S_OK)) ||
+      (playback->m_deckLinkOutput->StartScheduledPlayback(0, playback->m_timeScale, 1.0) != S_OK)) {
+    playback->linkStartFailures_.increment();
+    return;
+  }
+  uv_mutex_lock(&playback->padlock);
+  playback->playing_ = true;
+  uv_mutex_unlock(&playback->padlock);
+}
+
+int32_t Playback::syncLinkLocked(IDeckLinkVideoInputFrame* frame) {
+  BMDTimeValue outputTime = 0;
+  double speed = 0.0;
+  BMDTimeValue inputTime = 0;
+  BMDTimeValue inputDuration = 0;
+  if ((m_deckLinkOutput->GetScheduledStreamTime(m_timeScale, &outputTime, &speed) != S_OK) ||
+      (speed <= 0.0) ||
+      (frame->GetStreamTime(&inputTime, &inputDuration, m_timeScale) != S_OK)) {
+    linkSynced_ = false; // Not playing yet, or no input time to follow
+    return 0;
+  }
+  BMDTimeValue target = (BMDTimeValue) linkDelay_ * m_frameDuration;
+  // Time queued ahead of the output's position once this frame is added
+  BMDTimeValue queued = (BMDTimeValue) (m_totalFrameScheduled + 1) * m_frameDuration - outputTime;
+  if (queued <= 0) {
+    // Linked frames have fallen behind the output, which has played filler
+    // or nothing. Every queued frame is in a slot before
+    // m_totalFrameScheduled, so skipping on to the next slot the output
+    // will play never lands on one.
+    uint32_t slot = (uint32_t) (outputTime / m_frameDuration + 1);
+    if (slot > m_totalFrameScheduled) {
+      m_totalFrameScheduled = slot;
+      if (hasAudio_ && (audioRing_ == NULL))
+        m_totalSampleScheduled = (uint64_t) m_totalFrameScheduled * m_frameDuration *
+          audioSampleRate_ / m_timeScale;
+    }
+    syncResets_.increment();
+    linkSynced_ = false;
+    queued = (BMDTimeValue) (m_totalFrameScheduled + 1) * m_frameDuration - outputTime;
+  }
+
+  if (linkSynced_) {
+    BMDTimeValue gap = inputTime - linkInputLast_;
+    if ((gap <= 0) || (gap > PLAYBACK_LINK_MAX_GAP * m_frameDuration))
+      linkSynced_ = false; // The input's stream time jumped, so start again
+    else if (gap > m_frameDuration + m_frameDuration / 2)
+      // Input frames were missed, so fewer frames were queued than the
+      // input's time has advanced by
+      linkInputBase_ += ((gap + m_frameDuration / 2) / m_frameDuration - 1) * m_frameDuration;
+  }
+  linkInputLast_ = inputTime;
+  if (!linkSynced_) {
+    linkSynced_ = true;
+    linkInputBase_ = inputTime;
+    linkOutputBase_ = outputTime;
+    linkQueuedBase_ = queued;
+  }
+
+  // Input time since the baseline counts the frames queued, and output time
+  // the frames played, so their difference is the drift of the input's
+  // clock from the output's. The output's time is read as each frame
+  // arrives, so callback latency shows as jitter of part of a frame.
+  BMDTimeValue drift = (inputTime - linkInputBase_) - (outputTime - linkOutputBase_);
+  BMDTimeValue error = linkQueuedBase_ + drift - target;
+  // Allow a frame either side of the target before correcting, so that
+  // jitter alone does not cause drops or repeats. Each correction moves the
+  // input baseline by the frames dropped or added.
+  if (error > m_frameDuration) {
+    linkInputBase_ += m_frameDuration;
+    return -1;
+  }
+  if (error < -m_frameDuration) {
+    int32_t repeats = (int32_t) (-error / m_frameDuration);
+    linkInputBase_ -= (BMDTimeValue) repeats * m_frameDuration;
+    return repeats;
+  }
+  return 0;
+}
+
+NAN_METHOD(Playback::PlaySequence) {
+  Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  if (!info[0]->IsArray() || !info[5]->IsFunction()) {
+    Nan::ThrowTypeError("Playing a sequence requires a list of files and a callback.");
+    return;
+  }
+  if (obj->m_deckLinkOutput == NULL) {
+    info.GetReturnValue().Set(Nan::New("Playback is not initialised.").ToLocalChecked());
+    return;
+  }
+  obj->sweepRetired();
+  if (obj->source_ != NULL) {
+    info.GetReturnValue().Set(Nan::New("Already playing a sequence.").ToLocalChecked());
+    return;
+  }
+  v8::Local<v8::Array> list = v8::Local<v8::Array>::Cast(info[0]);
+  std::vector<std::string> files;
+  for ( uint32_t x = 0 ; x < list->Length() ; x++ )
+    files.push_back(*Nan::Utf8String(Nan::Get(list, x).ToLocalChecked()));
+  uint32_t lookahead = info[1]->IsNumber() ? Nan::To<uint32_t>(info[1]).FromJust() : 8;
+  uint32_t threads = info[2]->IsNumber() ? Nan::To<uint32_t>(info[2]).FromJust() : 2;
+  bool loop = Nan::To<bool>(info[3]).FromJust();
+  uint32_t depth = info[4]->IsNumber() ? Nan::To<uint32_t>(info[4]).FromJust() : 0;
+  if (lookahead < 2) lookahead = 2;
+  if (threads < 1) threads = 1;
+
+  SequenceSource* source = new SequenceSource(files, loop);
+  const char* error = source->start(obj->m_deckLinkOutput, obj->m_width, obj->m_height,
+    obj->frameRowBytes(), (BMDPixelFormat) obj->pixelFormat_, obj->inputFormat_,
+    lookahead, threads);
+  if (error != NULL) {
+    delete source;
+    info.GetReturnValue().Set(Nan::New(error).ToLocalChecked());
+    return;
+  }
+  obj->sequenceCB_.Reset(v8::Local<v8::Function>::Cast(info[5]));
+
+  uv_mutex_lock(&obj->padlock);
+  // Sequence frames are fed by the scheduler as frames complete. Its
+  // settings are put back when the sequence is retired.
+  obj->sequenceRestoreEnabled_ = obj->schedulerEnabled_;
+  obj->sequenceRestoreDepth_ = obj->schedulerDepth_;
+  if (depth > 0)
+    obj->schedulerDepth_ = depth;
+  else if (!obj->schedulerEnabled_)
+    obj->schedulerDepth_ = (lookahead > 4) ? 4 : lookahead - 1;
+  obj->schedulerEnabled_ = true;
+  depth = obj->schedulerDepth_;
+  uv_mutex_unlock(&obj->padlock);
+
+  // Give the readers a moment to get ahead before the preroll
+  source->waitReady(depth, 1000);
+  uv_mutex_lock(&obj->padlock);
+  obj->source_ = source;
+  obj->sequenceEnded_ = false;
+  obj->topUpFrames();
+  obj->pendingFillers_ = 0; // Not an underrun
+  uv_mutex_unlock(&obj->padlock);
+
+  info.GetReturnValue().Set(Nan::New("Sequence started.").ToLocalChecked());
+}
+
+NAUV_WORK_CB(Playback::SequenceCallback) {
+  Nan::HandleScope scope;
+  Playback *playback = static_cast<Playback*>(async->data);
+  // Retire the ended sequence, so that another can be played straight away
+  uv_mutex_lock(&playback->padlock);
+  if ((playback->source_ != NULL) && playback->sequenceEnded_) {
+    playback->retired_.push_back(playback->source_);
+    playback->source_ = NULL;
+    playback->schedulerEnabled_ = playback->sequenceRestoreEnabled_;
+    playback->schedulerDepth_ = playback->sequenceRestoreDepth_;
+  }
+  uv_mutex_unlock(&playback->padlock);
+  playback->sweepRetired();
+  if (playback->sequenceCB_.IsEmpty())
+    return;
+  Nan::Callback cb(Nan::New(playback->sequenceCB_));
+  cb.Call(0, NULL);
+}
+
+void Playback::sweepRetired() {
+  std::vector<SequenceSource*> idle;
+  uv_mutex_lock(&padlock);
+  for ( auto it = retired_.begin() ; it != retired_.end() ; ) {
+    if ((*it)->inUse()) {
+      ++it;
+    } else {
+      idle.push_back(*it);
+      it = retired_.erase(it);
+    }
+  }
+  uv_mutex_unlock(&padlock);
+  for ( auto source : idle )
+    delete source;
+}
+
+NAN_METHOD(Playback::WriteAudio) {
+  Playback* obj = ObjectWrap::Unwrap<Playback>(info.Holder());
+  if (obj->audioRing_ == NULL) {
+    info.GetReturnValue().Set(Nan::New("Audio is not pulled from a buffer.").ToLocalChecked());
+    return;
+  }
+  if (!node::Buffer::HasInstance(info[0])) {
+    Nan::ThrowTypeError("Audio must be a buffer.");
+    return;
+  }
+  v8::Local<v8::Object> audBufObj = info[0].As<v8::Object>();
+  // Only whole sample frames, so the ring never splits a sample frame
+  size_t bytes = node::Buffer::Length(audBufObj) / obj->sampleByteFactor_ * obj->sampleByteFactor_;
+  uv_mutex_lock(&obj->padlock);
+  size_t written = obj->audioRing_->write(node::Buffer::Data(audBufObj), bytes);
+  uv_mutex_unlock(&obj->padlock);
+  obj->audioLow_ = false;
+
+  info.GetReturnValue().Set((uint32_t) (written / obj->sampleByteFactor_));
 }
 
 NAN_METHOD(Playback::EnableAudio) {
@@ -259,9 +1077,19 @@ NAN_METHOD(Playback::EnableAudio) {
   BMDAudioSampleType sampleType = info[1]->IsNumber() ?
       (BMDAudioSampleType) Nan::To<uint32_t>(info[1]).FromJust() : bmdAudioSampleType16bitInteger;
   uint32_t channelCount = info[2]->IsNumber() ? Nan::To<uint32_t>(info[2]).FromJust() : 2;
+  // A ring size in sample frames selects pulled audio, with the callback
+  // asking for more
+  uint32_t ringSamples = info[3]->IsNumber() ? Nan::To<uint32_t>(info[3]).FromJust() : 0;
 
-  // Setting stream type as timestamped - should be good enough
-  result = obj->setupAudioOutput(sampleRate, sampleType, channelCount, bmdAudioOutputStreamTimestamped);
+  if ((ringSamples > 0) && info[4]->IsFunction() && (obj->audioRing_ == NULL)) {
+    obj->audioRing_ = new AudioRing((size_t) ringSamples * channelCount * (sampleType / 8));
+    obj->audioTarget_ = sampleRate * PLAYBACK_AUDIO_CARD_MS / 1000;
+    obj->audioCB_.Reset(v8::Local<v8::Function>::Cast(info[4]));
+    result = obj->setupAudioOutput(sampleRate, sampleType, channelCount, bmdAudioOutputStreamContinuous);
+  } else {
+    // Setting stream type as timestamped - should be good enough
+    result = obj->setupAudioOutput(sampleRate, sampleType, channelCount, bmdAudioOutputStreamTimestamped);
+  }
 
   switch (result) {
     case E_INVALIDARG:
@@ -283,59 +1111,280 @@ NAN_METHOD(Playback::EnableAudio) {
 
 bool Playback::setupDeckLinkOutput() {
   // bool							result = false;
-  IDeckLinkDisplayModeIterator*	displayModeIterator = NULL;
-  IDeckLinkDisplayMode*			deckLinkDisplayMode = NULL;
-
   m_width = -1;
 
   // set callback
   m_deckLinkOutput->SetScheduledFrameCompletionCallback(this);
 
   // get frame scale and duration for the video mode
-  if (m_deckLinkOutput->GetDisplayModeIterator(&displayModeIterator) != S_OK)
+  const ModeCatalogue* catalogue = ModeCatalogue::forDevice(deviceIndex_, m_deckLink);
+  const ModeEntry* entry = (catalogue != NULL) ? catalogue->find(displayMode_) : NULL;
+  if (entry == NULL)
     return false;
+  m_width = entry->width;
+  m_height = entry->height;
+  m_frameDuration = entry->frameDuration;
+  m_timeScale = entry->timeScale;
 
-  while (displayModeIterator->Next(&deckLinkDisplayMode) == S_OK)
-  {
-    if (deckLinkDisplayMode->GetDisplayMode() == displayMode_)
-    {
-      m_width = deckLinkDisplayMode->GetWidth();
-      m_height = deckLinkDisplayMode->GetHeight();
-      deckLinkDisplayMode->GetFrameRate(&m_frameDuration, &m_timeScale);
-      deckLinkDisplayMode->Release();
+  if (m_deckLinkOutput->EnableVideoOutput((BMDDisplayMode) displayMode_, bmdVideoOutputFlagDefault) != S_OK)
+    return false;
 
-      break;
-    }
+  if (!createFrames())
+    poolCreateFailures_.increment(); // Frames are allocated as needed instead
+
+  if (m_deckLinkOutput->CreateVideoFrame(m_width, m_height, frameRowBytes(),
+      (BMDPixelFormat) pixelFormat_, bmdFrameFlagDefault, &blackFrame_) == S_OK)
+    fillFrame(blackFrame_);
+  else
+    blackFrame_ = NULL;
 
-    deckLinkDisplayMode->Release();
+  return true;
+}
+
+long Playback::frameRowBytes() {
+  return FrameGeometry(pixelFormat_, m_width, m_height).rowBytes;
+}
+
+bool Playback::createFrames() {
+  IDeckLinkMutableVideoFrame** frames = new IDeckLinkMutableVideoFrame*[PLAYBACK_FRAME_COUNT];
+  for ( uint32_t x = 0 ; x < PLAYBACK_FRAME_COUNT ; x++ ) {
+    if (m_deckLinkOutput->CreateVideoFrame(m_width, m_height, frameRowBytes(),
+        (BMDPixelFormat) pixelFormat_, bmdFrameFlagDefault, &frames[x]) != S_OK) {
+      while (x > 0) frames[--x]->Release();
+      delete[] frames;
+      return false;
+    }
   }
 
-  displayModeIterator->Release();
+  uv_mutex_lock(&padlock);
+  m_videoFrames = frames;
+  m_videoFrameHolds = new uint32_t[PLAYBACK_FRAME_COUNT];
+  m_videoFrameCount = PLAYBACK_FRAME_COUNT;
+  m_nextFrameIndex = 0;
+  for ( uint32_t x = 0 ; x < m_videoFrameCount ; x++ ) {
+    m_videoFrameHolds[x] = 0;
+    fillFrame(m_videoFrames[x]);
+  }
+  uv_mutex_unlock(&padlock);
+  return true;
+}
 
-  if (m_width == -1)
+// Fill a frame with black, so that a frame played before it is written shows
+// nothing rather than stale memory.
+bool Playback::fillFrame(IDeckLinkVideoFrame* frame) {
+  uint32_t* data;
+  if (frame->GetBytes((void**) &data) != S_OK)
     return false;
+  long words = frame->GetRowBytes() * frame->GetHeight() / 4;
+  switch (pixelFormat_) {
+    case bmdFormat10BitYUV: // Cb Y Cr / Y Cb Y ... at video levels 512, 64, 512
+      for ( long x = 0 ; x < words ; x++ )
+        data[x] = (x & 1) ? 0x04080040 : 0x20010200;
+      break;
+    case bmdFormat8BitYUV: // Cb Y Cr Y bytes 128, 16, 128, 16
+      for ( long x = 0 ; x < words ; x++ )
+        data[x] = 0x10801080;
+      break;
+    default:
+      memset(data, 0, words * 4);
+      break;
+  }
+  return true;
+}
 
-  if (m_deckLinkOutput->EnableVideoOutput((BMDDisplayMode) displayMode_, bmdVideoOutputFlagDefault) != S_OK)
-    return false;
+void Playback::releaseFrames() {
+  uv_mutex_lock(&padlock);
+  if (lastFrame_ != NULL) {
+    dropFrame(lastFrame_);
+    lastFrame_ = NULL;
+  }
+  IDeckLinkMutableVideoFrame** frames = m_videoFrames;
+  uint32_t frameCount = m_videoFrameCount;
+  delete[] m_videoFrameHolds;
+  m_videoFrames = NULL;
+  m_videoFrameHolds = NULL;
+  m_videoFrameCount = 0;
+  if (blackFrame_ != NULL) {
+    blackFrame_->Release();
+    blackFrame_ = NULL;
+  }
+  uv_mutex_unlock(&padlock);
 
-  return true;
+  // Frames still held by the card stay alive until it releases them
+  for ( uint32_t x = 0 ; x < frameCount ; x++ )
+    frames[x]->Release();
+  delete[] frames;
+}
+
+int Playback::acquireFrame() {
+  int index = -1;
+  uv_mutex_lock(&padlock);
+  for ( uint32_t x = 0 ; x < m_videoFrameCount ; x++ ) {
+    uint32_t candidate = (m_nextFrameIndex + x) % m_videoFrameCount;
+    if (m_videoFrameHolds[candidate] == 0) {
+      m_videoFrameHolds[candidate] = 1;
+      m_nextFrameIndex = (candidate + 1) % m_videoFrameCount;
+      index = (int) candidate;
+      break;
+    }
+  }
+  uv_mutex_unlock(&padlock);
+  return index;
+}
+
+void Playback::holdFrame(IDeckLinkVideoFrame* frame) {
+  if ((source_ != NULL) && source_->hold(frame))
+    return;
+  for ( auto source : retired_ ) {
+    if (source->hold(frame)) return;
+  }
+  for ( uint32_t x = 0 ; x < m_videoFrameCount ; x++ ) {
+    if (m_videoFrames[x] == frame) {
+      m_videoFrameHolds[x]++;
+      return;
+    }
+  }
+  frame->AddRef();
+}
+
+void Playback::dropFrame(IDeckLinkVideoFrame* frame) {
+  if ((source_ != NULL) && source_->drop(frame))
+    return;
+  for ( auto source : retired_ ) {
+    if (source->drop(frame)) return;
+  }
+  // Ring frames are kept for reuse, others were made for this use only
+  for ( uint32_t x = 0 ; x < m_videoFrameCount ; x++ ) {
+    if (m_videoFrames[x] == frame) {
+      if (m_videoFrameHolds[x] > 0) m_videoFrameHolds[x]--;
+      return;
+    }
+  }
+  frame->Release();
+}
+
+uint32_t Playback::topUpFrames() {
+  uint32_t buffered = 0;
+  uint32_t queued = 0;
+  uint32_t fillers = 0;
+  if (m_deckLinkOutput->GetBufferedVideoFrameCount(&buffered) != S_OK)
+    return 0;
+  while (buffered + queued < schedulerDepth_) {
+    // Frames of a sequence that have been read come first
+    IDeckLinkVideoFrame* frame = (source_ != NULL) ? source_->next() : NULL;
+    bool filler = (frame == NULL);
+    if (filler) {
+      frame = schedulerRepeat_ ? lastFrame_ : NULL;
+      if (frame == NULL) frame = blackFrame_;
+      if (frame == NULL) break;
+      holdFrame(frame);
+    }
+    if (m_deckLinkOutput->ScheduleVideoFrame(frame,
+        (m_totalFrameScheduled * m_frameDuration),
+        m_frameDuration, m_timeScale) != S_OK) {
+      dropFrame(frame);
+      break;
+    }
+    m_totalFrameScheduled++;
+    queued++;
+    if (!filler) {
+      sequenceFrames_.increment();
+      if (schedulerRepeat_) {
+        holdFrame(frame);
+        if (lastFrame_ != NULL) dropFrame(lastFrame_);
+        lastFrame_ = frame;
+      }
+    } else if (frame == blackFrame_) {
+      fillers++;
+      framesBlack_.increment();
+    } else {
+      fillers++;
+      framesRepeated_.increment();
+    }
+  }
+  if ((queued > 0) && hasAudio_) {
+    // Leave silence under frames without audio, keeping later audio in step
+    uint64_t videoSamples = (uint64_t) m_totalFrameScheduled * m_frameDuration *
+      audioSampleRate_ / m_timeScale;
+    if (videoSamples > m_totalSampleScheduled)
+      m_totalSampleScheduled = videoSamples;
+  }
+  if ((source_ != NULL) && !sequenceEnded_ && source_->ended()) {
+    sequenceEnded_ = true;
+    uv_async_send(sequenceAsync);
+  }
+  pendingFillers_ += fillers;
+  return fillers;
 }
 
 HRESULT	Playback::ScheduledFrameCompleted (IDeckLinkVideoFrame* completedFrame, BMDOutputFrameCompletionResult result)
-{
-  uv_mutex_lock(&padlock);
-  result_ = result;
-  completedFrame->Release(); // Assume you should do this
-  uv_mutex_unlock(&padlock);
-  uv_async_send(async);
+{
+  framesCompleted_.increment();
+  switch (result) {
+    case bmdOutputFrameDisplayedLate:
+      framesDisplayedLate_.increment();
+      break;
+    case bmdOutputFrameDropped:
+      framesDropped_.increment();
+      break;
+    case bmdOutputFrameFlushed:
+      framesFlushed_.increment();
+      break;
+    default:
+      break;
+  }
+  bool notify = !linkStarted_.load(std::memory_order_relaxed);
+  if (notify) {
+    PlaybackCompletion completion;
+    completion.sequence = completionSequence_++;
+    completion.result = result;
+    completion.hasTimestamp = m_deckLinkOutput->GetFrameCompletionReferenceTimestamp(
+      completedFrame, m_timeScale, &completion.timestamp) == S_OK;
+    if (!completions_.push(completion))
+      completionsLost_.increment(); // JS is more than a queue's length behind
+  }
+
+  uint32_t fillers = 0;
+  uv_mutex_lock(&padlock);
+  dropFrame(completedFrame);
+  if (schedulerEnabled_ && (result != bmdOutputFrameFlushed))
+    fillers = topUpFrames();
+  uv_mutex_unlock(&padlock);
+  if (fillers > 0) {
+    underruns_.increment();
+    uv_async_send(underrunAsync);
+  }
+  if (notify) uv_async_send(async);
 	return S_OK;
 }
 
 void Playback::cleanupDeckLinkOutput()
 {
+	stopJobThread();
+	unlinkCapture();
 	m_deckLinkOutput->StopScheduledPlayback(0, NULL, 0);
 	m_deckLinkOutput->DisableVideoOutput();
 	m_deckLinkOutput->SetScheduledFrameCompletionCallback(NULL);
+	if (audioRing_ != NULL)
+	  m_deckLinkOutput->SetAudioCallback(NULL);
+	releaseFrames();
+	uv_mutex_lock(&padlock);
+	playing_ = false;
+	uv_mutex_unlock(&padlock);
+	linkStarted_ = false;
+	releaseSequences();
+}
+
+void Playback::releaseSequences() {
+  for ( auto source : retired_ )
+    delete source;
+  retired_.clear();
+  if (source_ != NULL) { // Callbacks have stopped, so no lock is needed
+    delete source_;
+    source_ = NULL;
+    schedulerEnabled_ = sequenceRestoreEnabled_;
+    schedulerDepth_ = sequenceRestoreDepth_;
+  }
 }
 
 HRESULT Playback::setupAudioOutput(BMDAudioSampleRate sampleRate, BMDAudioSampleType sampleType,
@@ -347,25 +1396,101 @@ HRESULT Playback::setupAudioOutput(BMDAudioSampleRate sampleRate, BMDAudioSample
   m_totalSampleScheduled = 0;
   HRESULT result = m_deckLinkOutput->EnableAudioOutput(sampleRate, sampleType, channelCount, streamType);
 
+  // The callback must be set before preroll to be asked for preroll audio
+  if ((result == S_OK) && (audioRing_ != NULL))
+    m_deckLinkOutput->SetAudioCallback(this);
+
   if (m_deckLinkOutput->BeginAudioPreroll() != S_OK)
     printf("Failed to begin audio preroll.\n");
 
   return result;
 }
 
-NAUV_WORK_CB(Playback::FrameCallback) {
+// Called by the card, on its own thread, when it can take more audio.
+HRESULT Playback::RenderAudioSamples(bool preroll) {
+  uint32_t buffered = 0;
+  if ((audioRing_ == NULL) ||
+      (m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&buffered) != S_OK))
+    return S_OK;
+
+  while (buffered < audioTarget_) {
+    const char* data;
+    uint32_t sampleFrames = (uint32_t) (audioRing_->peek(&data) / sampleByteFactor_);
+    if (sampleFrames == 0) {
+      if (!preroll) audioUnderruns_.increment();
+      break;
+    }
+    if (sampleFrames > audioTarget_ - buffered)
+      sampleFrames = audioTarget_ - buffered;
+    uint32_t sampleFramesWritten = 0;
+    if (m_deckLinkOutput->ScheduleAudioSamples((void*) data, sampleFrames, 0, 0,
+        &sampleFramesWritten) != S_OK)
+      break;
+    audioRing_->consume((size_t) sampleFramesWritten * sampleByteFactor_);
+    buffered += sampleFramesWritten;
+    if (sampleFramesWritten < sampleFrames) break; // Card is full
+  }
+
+  // Ask JS for more once the ring is half empty
+  if ((audioRing_->size() < audioRing_->capacity() / 2) && !audioLow_.exchange(true))
+    uv_async_send(audioAsync);
+  return S_OK;
+}
+
+NAUV_WORK_CB(Playback::AudioCallback) {
   Nan::HandleScope scope;
   Playback *playback = static_cast<Playback*>(async->data);
-  uv_mutex_lock(&playback->padlock);
-  if (!playback->playbackCB_.IsEmpty()) {
-    Nan::Callback cb(Nan::New(playback->playbackCB_));
+  if ((playback->audioRing_ == NULL) || playback->audioCB_.IsEmpty())
+    return;
+  size_t space = playback->audioRing_->capacity() - playback->audioRing_->size();
+  // Clear first, so that the callback can write audio and be asked again
+  playback->audioLow_ = false;
+  Nan::Callback cb(Nan::New(playback->audioCB_));
+  v8::Local<v8::Value> argv[1] = {
+    Nan::New<v8::Number>((double) (space / playback->sampleByteFactor_)) };
+  cb.Call(1, argv);
+}
 
-    v8::Local<v8::Value> argv[1] = { Nan::New(playback->result_) };
-    cb.Call(1, argv);
-  } else {
+NAUV_WORK_CB(Playback::UnderrunCallback) {
+  Nan::HandleScope scope;
+  Playback *playback = static_cast<Playback*>(async->data);
+  uv_mutex_lock(&playback->padlock);
+  uint32_t fillers = playback->pendingFillers_;
+  playback->pendingFillers_ = 0;
+  uv_mutex_unlock(&playback->padlock);
+  if ((fillers == 0) || playback->underrunCB_.IsEmpty())
+    return;
+
+  v8::Local<v8::Object> underrun = Nan::New<v8::Object>();
+  Nan::Set(underrun, Nan::New("frames").ToLocalChecked(), Nan::New<v8::Number>(fillers));
+  Nan::Set(underrun, Nan::New("underruns").ToLocalChecked(),
+    Nan::New<v8::Number>((double) playback->underruns_.get()));
+  Nan::Callback cb(Nan::New(playback->underrunCB_));
+  v8::Local<v8::Value> argv[1] = { underrun };
+  cb.Call(1, argv);
+}
+
+NAUV_WORK_CB(Playback::FrameCallback) {
+  Nan::HandleScope scope;
+  Playback *playback = static_cast<Playback*>(async->data);
+  playback->asyncWakeups_.increment();
+  PlaybackCompletion completion;
+  // Sends to the async handle may have been merged, so report every
+  // completion queued. The callback may schedule frames, so no lock is held.
+  if (playback->playbackCB_.IsEmpty()) {
     printf("Frame callback is empty. Assuming finished.\n");
+    while (playback->completions_.pop(completion)) {}
+    return;
   }
-  uv_mutex_unlock(&playback->padlock);
-}
+  Nan::Callback cb(Nan::New(playback->playbackCB_));
+  while (playback->completions_.pop(completion)) {
+    v8::Local<v8::Value> timestamp = Nan::Undefined();
+    if (completion.hasTimestamp)
+      timestamp = Nan::New<v8::Number>((double) completion.timestamp);
+    v8::Local<v8::Value> argv[3] = { Nan::New<v8::Number>(completion.result),
+      Nan::New<v8::Number>((double) completion.sequence), timestamp };
+    cb.Call(3, argv);
+  }
+}
 
 }
@@ -50,10 +50,55 @@
 #include <nan.h>
 
 #include "DeckLinkAPI.h"
+#include "RingBuffer.h"
+#include "AudioRing.h"
+#include "StatCounter.h"
+#include "BufferFrame.h"
+#include "SequenceSource.h"
+#include <deque>
+#include <vector>
+
+// Number of frames pre-created for playback and recycled as they complete
+#define PLAYBACK_FRAME_COUNT 16
+// Maximum number of frame completions waiting for delivery to JS
+#define PLAYBACK_COMPLETION_DEPTH 128
+// With pulled audio, milliseconds of audio to keep queued on the card
+#define PLAYBACK_AUDIO_CARD_MS 100
+// With link sync, a jump in the input's stream time of more frames than this
+// starts the sync again
+#define PLAYBACK_LINK_MAX_GAP 8
 
 namespace streampunk {
 
-class Playback : public IDeckLinkVideoOutputCallback, public Nan::ObjectWrap
+class Capture;
+
+// A completed frame as passed from the output callback to the event loop.
+// Frames complete in the order they were scheduled, so the sequence number
+// counts completions and matches the frame's position in the schedule.
+struct PlaybackCompletion {
+  uint64_t sequence;
+  BMDOutputFrameCompletionResult result;
+  bool hasTimestamp;
+  BMDTimeValue timestamp; // in the display mode's time scale
+};
+
+// A frame waiting for the scheduling thread. The buffers are held so that
+// their memory stays valid until the job is done.
+struct ScheduleJob {
+  Nan::Persistent<v8::Promise::Resolver> resolver;
+  Nan::Persistent<v8::Object> video;
+  Nan::Persistent<v8::Object> audio;
+  IDeckLinkVideoFrame* wrapped; // zero copy frame, or NULL to copy videoData
+  const char* videoData;
+  size_t videoLength;
+  const char* audioData; // NULL for no audio
+  size_t audioLength;
+  const char* error; // set when done, NULL on success
+  uint32_t scheduled;
+};
+
+class Playback : public IDeckLinkVideoOutputCallback, public IDeckLinkAudioOutputCallback,
+  public Nan::ObjectWrap
 {
 private:
   explicit Playback(uint32_t deviceIndex = 0, uint32_t displayMode = 0, uint32_t pixelFormat = 0);
@@ -61,6 +106,7 @@ private:
 
   static NAN_METHOD(New);
   static inline Nan::Persistent<v8::Function> &constructor();
+  static inline Nan::Persistent<v8::FunctionTemplate> &prototype();
 
 	IDeckLink *					m_deckLink;
 	IDeckLinkOutput *			m_deckLinkOutput;
@@ -77,8 +123,12 @@ private:
 	bool						m_waitingForExportEnd;
 	bool						m_exportStarted;
 
-	// array of coloured frames
+	// ring of frames created up front and reused once played, with a count
+	// per frame of the holds on it - once for each time it is queued on the
+	// card, plus one while the scheduler may repeat it. Guarded by padlock.
 	IDeckLinkMutableVideoFrame** m_videoFrames;
+	uint32_t*					m_videoFrameHolds;
+	uint32_t					m_videoFrameCount;
 	uint32_t					m_nextFrameIndex;
 	uint32_t					m_totalFrameScheduled;
   uint64_t          m_totalSampleScheduled;
@@ -89,15 +139,57 @@ private:
 	BMDTimeScale				m_timeScale;
 	BMDTimeValue				m_frameDuration;
 
-	bool			fillFrame(int index);
+	bool			fillFrame(IDeckLinkVideoFrame* frame);
 	void			releaseFrames();
 	bool			createFrames();
+	// claim the next free frame of the ring, or return -1 if all are in use
+	int				acquireFrame();
+	// take or drop one hold on a frame, counted for ring frames and as a
+	// reference otherwise. padlock must be held.
+	void			holdFrame(IDeckLinkVideoFrame* frame);
+	void			dropFrame(IDeckLinkVideoFrame* frame);
+	long			frameRowBytes();
+
+	// Wrap a buffer as a frame when zero copy is enabled and possible, or
+	// return NULL. Event loop thread only.
+	IDeckLinkVideoFrame* wrapFrame(v8::Local<v8::Object> bufObj);
+	// Copy frame data into a frame from the ring or a new frame, converting
+	// from the input format. Returns an
+	// error message, or NULL on success. Any thread.
+	const char*		copyFrame(const char* data, size_t length, IDeckLinkVideoFrame** frame);
+	// As copyFrame, for a whole frame of the playback size with rows of
+	// srcRowBytes in srcFormat. Any thread.
+	const char*		copyFrameFrom(const char* data, long srcRowBytes, uint32_t srcFormat,
+						IDeckLinkVideoFrame** frame);
+	// Schedule a frame and its audio next, taking over the caller's hold on
+	// the frame. Returns an error message, or NULL with the count of frames
+	// scheduled so far. Any thread.
+	const char*		scheduleFrame(IDeckLinkVideoFrame* frame, const char* audio,
+						size_t audioLength, uint32_t* scheduled);
+	// As scheduleFrame, with padlock already held
+	const char*		scheduleFrameLocked(IDeckLinkVideoFrame* frame, const char* audio,
+						size_t audioLength, uint32_t* scheduled);
+
+	// Frame sync for a link: follow the drift of the input frame's stream
+	// time against the output's, from a baseline of the time queued ahead of
+	// the output, and compare with the link delay. Returns -1 to drop the
+	// frame, or the number of times to repeat it. linkLock and padlock must
+	// be held.
+	int32_t			syncLinkLocked(IDeckLinkVideoInputFrame* frame);
+
+	// queue filler frames until the card has the scheduler's target depth,
+	// returning the number queued. padlock must be held.
+	uint32_t		topUpFrames();
 
 	bool			setupDeckLinkOutput();
 
 	bool			scheduleNextFrame(bool preroll);
 
 	void			cleanupDeckLinkOutput();
+	// drop the references to the device taken by init
+	void			releaseDeckLink();
+	// end any link from a capture, so that it stops sending frames
+	void			unlinkCapture();
 
   HRESULT setupAudioOutput(BMDAudioSampleRate sampleRate, BMDAudioSampleType sampleType,
     uint32_t channelCount, BMDAudioOutputStreamType streamType);
@@ -114,25 +206,197 @@ private:
 
   static NAN_METHOD(SchedukeAudio);
 
+  static NAN_METHOD(ScheduleFrameAsync);
+
+  static NAN_METHOD(ScheduleFrames);
+
+  static NAN_METHOD(WriteAudio);
+
+  static NAN_METHOD(PlaySequence);
+
+  static NAUV_WORK_CB(SequenceCallback);
+
+  // delete retired sources with no frames still held. Event loop only.
+  void sweepRetired();
+  // stop and delete every source, once output callbacks have stopped
+  void releaseSequences();
+
+  static NAUV_WORK_CB(AudioCallback);
+
+  static void JobThread(void* arg);
+
+  static NAUV_WORK_CB(JobCallback);
+
+  // finish queued jobs and stop the scheduling thread
+  void stopJobThread();
+
   static NAUV_WORK_CB(FrameCallback);
 
   static NAN_METHOD(TestStuff);
 
+  static NAN_METHOD(GetStats);
+
+  static NAN_METHOD(EnableZeroCopy);
+
+  static NAN_METHOD(SetInputFormat);
+
+  static NAN_METHOD(EnableScheduler);
+
+  static NAUV_WORK_CB(UnderrunCallback);
+
+  static NAUV_WORK_CB(LinkCallback);
+
   uint32_t deviceIndex_;
   uint32_t displayMode_;
   uint32_t pixelFormat_;
+  // Format of the frames from JS, converted to pixelFormat_ as they are
+  // copied to the card. Set on the event loop and read by any thread
+  // preparing a frame, so a change applies to frames not yet prepared.
+  uint32_t inputFormat_;
   uint32_t sampleByteFactor_;
   BMDAudioSampleRate audioSampleRate_;
   Nan::Persistent<v8::Function> playbackCB_;
-  uint32_t result_;
+  RingBuffer<PlaybackCompletion> completions_;
+  uint64_t completionSequence_; // output callback thread only
   bool hasAudio_ = false;
+  // When set, frames are played straight from the memory of the JS buffers
+  // passed to scheduleFrame, which are kept alive until played.
+  bool zeroCopy_;
+  FrameReclaimer* reclaimer_;
+  // When the scheduler is enabled, each completion tops up the frames queued
+  // on the card to schedulerDepth_, repeating lastFrame_ or playing
+  // blackFrame_. Filler frames since the last underrun event are counted in
+  // pendingFillers_. All guarded by padlock.
+  bool schedulerEnabled_;
+  uint32_t schedulerDepth_;
+  bool schedulerRepeat_;
+  IDeckLinkVideoFrame* lastFrame_;
+  IDeckLinkMutableVideoFrame* blackFrame_;
+  uint32_t pendingFillers_;
+  uv_async_t *underrunAsync;
+  Nan::Persistent<v8::Function> underrunCB_;
+  // Frames from scheduleFrameAsync are prepared and scheduled in order on
+  // jobThread_, started on first use. jobs_, jobsDone_ and
+  // jobThreadStopping_ are guarded by jobLock.
+  uv_thread_t jobThread_;
+  bool jobThreadRunning_;
+  bool jobThreadStopping_;
+  uv_mutex_t jobLock;
+  uv_cond_t jobReady;
+  std::deque<ScheduleJob*> jobs_;
+  std::vector<ScheduleJob*> jobsDone_;
+  uv_async_t *jobAsync;
+  // With pulled audio, samples written by JS wait in audioRing_ until the
+  // card asks for more through RenderAudioSamples. The card is kept topped
+  // up to audioTarget_ sample frames. audioLow_ is set while an event
+  // asking JS for more audio is pending. Audio is written to the ring from
+  // several threads, so writers hold padlock to act as its one producer.
+  AudioRing* audioRing_;
+  uint32_t audioTarget_;
+  std::atomic<bool> audioLow_;
+  uv_async_t *audioAsync;
+  Nan::Persistent<v8::Function> audioCB_;
+  // A sequence of files read ahead natively, played by the scheduler ahead of
+  // any filler frames. Set on the event loop with padlock held, so the
+  // output callback can use it under padlock. sequenceEnded_ is set once the
+  // last frame of a sequence that does not loop has been queued. An ended
+  // source is retired to retired_, also guarded by padlock, until the card
+  // and the scheduler have let go of its frames. The scheduler settings from
+  // before the sequence are restored when it is retired.
+  SequenceSource* source_;
+  std::vector<SequenceSource*> retired_;
+  bool sequenceEnded_;
+  bool sequenceRestoreEnabled_;
+  uint32_t sequenceRestoreDepth_;
+  uv_async_t *sequenceAsync;
+  Nan::Persistent<v8::Function> sequenceCB_;
+  // Set once scheduled playback has started, by doPlayback or by a linked
+  // capture. Guarded by padlock.
+  bool playing_;
+  // While linked to a capture, frames are scheduled from the input callback.
+  // Playback starts after linkPreroll_ more frames if it is not already
+  // running, with linkStartPending_ set until linkAsync starts it on the
+  // event loop. Captured audio is scheduled with each frame when linkAudio_ is
+  // set. Guarded by linkLock, which is held while each linked frame is
+  // prepared so that stopping waits for it. When the link started playback
+  // itself there is no JS callback, so linkStarted_ stops completions waking
+  // the event loop. With linkSync_ set, frames are dropped or repeated once
+  // playing as the input's clock drifts from the output's, to keep
+  // linkDelay_ frames queued, with repeats played against
+  // linkSilence_ to keep the audio in step.
+  uv_mutex_t linkLock;
+  // The linked capture, set and cleared on the event loop only
+  Capture* linkCapture_;
+  bool linked_;
+  uint32_t linkPreroll_;
+  bool linkStartPending_;
+  uv_async_t *linkAsync;
+  bool linkAudio_;
+  bool linkSync_;
+  uint32_t linkDelay_;
+  // Sync baseline, with the input's stream time of the last linked frame.
+  // Set again whenever either stream time is not continuous.
+  bool linkSynced_;
+  BMDTimeValue linkInputBase_;
+  BMDTimeValue linkOutputBase_;
+  BMDTimeValue linkQueuedBase_;
+  BMDTimeValue linkInputLast_;
+  std::vector<char> linkSilence_;
+  std::atomic<bool> linkStarted_;
+
+  // Written on the output callback thread
+  StatCounter framesCompleted_;
+  StatCounter framesDisplayedLate_;
+  StatCounter framesDropped_;
+  StatCounter framesFlushed_;
+  StatCounter underruns_;
+  StatCounter framesRepeated_;
+  StatCounter framesBlack_;
+  StatCounter sequenceFrames_;
+  StatCounter completionsLost_;
+  StatCounter audioUnderruns_;
+  // Written on the linked capture's input callback thread
+  StatCounter linkFramesShared_;
+  StatCounter linkFramesCopied_;
+  StatCounter linkFramesFailed_;
+  StatCounter syncFramesDropped_;
+  StatCounter syncFramesRepeated_;
+  StatCounter syncResets_;
+  // Written on the event loop thread
+  StatCounter asyncWakeups_;
+  StatCounter linkStartFailures_;
+  StatCounter poolCreateFailures_;
+  StatCounter framesWrapped_;
+  // Written from any thread preparing or scheduling frames, with padlock held
+  StatCounter framesAllocated_;
+  StatCounter audioSamplesDropped_;
 public:
   static NAN_MODULE_INIT(Init);
 
+  // The playback wrapped by a JS object, or NULL if it is not a Playback.
+  static Playback* fromObject(v8::Local<v8::Value> value);
+
+  // Passthrough from a capture (see Capture::Link). startLink checks that
+  // the capture's frame rate and audio match and prepares to start playback
+  // after delay frames; returns an error message, or NULL on success.
+  // startLink and endLink are for the event loop thread.
+  // With sync set, the linked frames are kept about delay frames ahead of
+  // the output, for a capture that is not locked to the output's reference.
+  const char* startLink(Capture* capture, uint32_t delay, bool sync,
+    BMDTimeValue frameDuration, BMDTimeScale timeScale, uint32_t sampleByteFactor);
+  void endLink();
+  // Schedule a captured frame and its audio next, playing the captured frame
+  // itself where its format and layout match the output, otherwise a copy.
+  // Input callback thread of the linked capture only.
+  void linkFrame(IDeckLinkVideoInputFrame* frame, IDeckLinkAudioInputPacket* audio);
+
 	// IDeckLinkVideoOutputCallback
 	virtual HRESULT	ScheduledFrameCompleted (IDeckLinkVideoFrame* completedFrame, BMDOutputFrameCompletionResult result);
 	virtual HRESULT	ScheduledPlaybackHasStopped () {return S_OK;};
 
+	// IDeckLinkAudioOutputCallback
+	virtual HRESULT	RenderAudioSamples (bool preroll);
+
 	// IUnknown
 	HRESULT			QueryInterface (REFIID iid, LPVOID *ppv)	{return E_NOINTERFACE;}
 	ULONG			AddRef ()									{return 1;}
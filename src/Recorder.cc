@@ -0,0 +1,324 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "Recorder.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+namespace streampunk {
+
+static char* alignedAlloc(size_t bytes) {
+  #ifdef WIN32
+  return (char*) _aligned_malloc(bytes, RECORDER_ALIGNMENT);
+  #else
+  void* data = NULL;
+  if (posix_memalign(&data, RECORDER_ALIGNMENT, bytes) != 0)
+    return NULL;
+  return (char*) data;
+  #endif
+}
+
+static void alignedFree(char* data) {
+  #ifdef WIN32
+  _aligned_free(data);
+  #else
+  free(data);
+  #endif
+}
+
+static size_t roundUp(size_t bytes) {
+  return (bytes + RECORDER_ALIGNMENT - 1) / RECORDER_ALIGNMENT * RECORDER_ALIGNMENT;
+}
+
+static bool isAligned(const void* data, size_t length) {
+  return (((uintptr_t) data % RECORDER_ALIGNMENT) == 0) &&
+    ((length % RECORDER_ALIGNMENT) == 0);
+}
+
+// Open for writing, with direct I/O where asked for and the platform and file
+// system support it. Clears direct if it had to fall back to buffered I/O.
+static uv_file openOutput(const char* path, bool& direct) {
+  uv_fs_t req;
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  int result = -1;
+  #ifdef UV_FS_O_DIRECT
+  if (direct && (UV_FS_O_DIRECT != 0)) {
+    result = uv_fs_open(NULL, &req, path, flags | UV_FS_O_DIRECT, 0644, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  #endif
+  if (result < 0) {
+    direct = false;
+    result = uv_fs_open(NULL, &req, path, flags, 0644, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  return result;
+}
+
+static void closeOutput(uv_file file) {
+  uv_fs_t req;
+  uv_fs_close(NULL, &req, file, NULL);
+  uv_fs_req_cleanup(&req);
+}
+
+static int truncateOutput(uv_file file, int64_t length) {
+  uv_fs_t req;
+  int result = uv_fs_ftruncate(NULL, &req, file, length, NULL);
+  uv_fs_req_cleanup(&req);
+  return result;
+}
+
+Recorder::Recorder(const std::string& path, bool sequence, uint32_t maxFrames,
+    bool direct, uv_async_t* notify) : path_(path), sequence_(sequence),
+    maxFrames_(maxFrames), direct_(direct), notify_(notify),
+    queue_(RECORDER_QUEUE_DEPTH), running_(false), started_(false),
+    framesAccepted_(0), file_(-1), offset_(0), bounce_(NULL), bounceSize_(0),
+    staged_(0) {
+  uv_sem_init(&ready_, 0);
+  uv_mutex_init(&padlock);
+}
+
+Recorder::~Recorder() {
+  stop();
+  if (bounce_ != NULL) alignedFree(bounce_);
+  uv_sem_destroy(&ready_);
+  uv_mutex_destroy(&padlock);
+}
+
+bool Recorder::validPattern(const std::string& path) {
+  int conversions = 0;
+  for ( size_t x = 0 ; x < path.length() ; x++ ) {
+    if (path[x] != '%') continue;
+    x++;
+    if ((x < path.length()) && (path[x] == '%')) continue;
+    // Allow flags and width only, e.g. %08d
+    while ((x < path.length()) && (strchr("0123456789-+ ", path[x]) != NULL)) x++;
+    if ((x >= path.length()) || ((path[x] != 'd') && (path[x] != 'u')))
+      return false;
+    conversions++;
+  }
+  return conversions == 1;
+}
+
+bool Recorder::start() {
+  if (!sequence_) {
+    file_ = openOutput(path_.c_str(), direct_);
+    if (file_ < 0) {
+      setError("Failed to open recording file", file_);
+      return false;
+    }
+  }
+  running_ = true;
+  if (uv_thread_create(&thread_, writerThread, this) != 0) {
+    running_ = false;
+    setError("Failed to start recording thread", 0);
+    return false;
+  }
+  started_ = true;
+  return true;
+}
+
+void Recorder::stop() {
+  if (started_) {
+    running_ = false;
+    uv_sem_post(&ready_);
+    uv_thread_join(&thread_);
+    started_ = false;
+  }
+
+  if (file_ >= 0) {
+    // Write out the partial block still staged for direct I/O, then cut the
+    // file back to the bytes actually recorded
+    if (staged_ > 0) {
+      size_t padded = roundUp(staged_);
+      memset(bounce_ + staged_, 0, padded - staged_);
+      writeAll(file_, bounce_, padded, offset_);
+      offset_ += staged_;
+      staged_ = 0;
+    }
+    truncateOutput(file_, offset_);
+    closeOutput(file_);
+    file_ = -1;
+  }
+}
+
+void Recorder::push(IDeckLinkVideoInputFrame* frame) {
+  if ((maxFrames_ > 0) && (framesAccepted_ >= maxFrames_))
+    return; // Recording is complete
+  frame->AddRef();
+  if (!queue_.push(frame)) {
+    frame->Release();
+    framesDropped_.increment();
+    uv_async_send(notify_);
+    return;
+  }
+  framesAccepted_++;
+  uv_sem_post(&ready_);
+}
+
+std::string Recorder::error() {
+  uv_mutex_lock(&padlock);
+  std::string error = error_;
+  uv_mutex_unlock(&padlock);
+  return error;
+}
+
+void Recorder::setError(const char* message, int code) {
+  uv_mutex_lock(&padlock);
+  if (error_.empty()) {
+    error_ = message;
+    if (code < 0) {
+      error_ += ": ";
+      error_ += uv_strerror(code);
+    }
+  }
+  uv_mutex_unlock(&padlock);
+  uv_async_send(notify_);
+}
+
+void Recorder::writerThread(void* arg) {
+  Recorder* recorder = static_cast<Recorder*>(arg);
+  IDeckLinkVideoInputFrame* frame;
+  bool failed = false;
+  // One post per queued frame plus one at stop, so the queue is always
+  // empty when the stop post is consumed
+  while (true) {
+    uv_sem_wait(&recorder->ready_);
+    if (!recorder->queue_.pop(frame)) {
+      if (!recorder->running_) break;
+      continue;
+    }
+    if (!failed) {
+      failed = !recorder->writeFrame(frame);
+      uv_async_send(recorder->notify_);
+    }
+    frame->Release();
+  }
+}
+
+bool Recorder::writeAll(uv_file file, const char* data, size_t length, int64_t offset) {
+  uv_fs_t req;
+  while (length > 0) {
+    uv_buf_t buf = uv_buf_init((char*) data, (unsigned int) length);
+    int result = uv_fs_write(NULL, &req, file, &buf, 1, offset, NULL);
+    uv_fs_req_cleanup(&req);
+    if (result <= 0) {
+      setError("Failed to write recording", result);
+      return false;
+    }
+    data += result;
+    length -= result;
+    offset += result;
+  }
+  return true;
+}
+
+bool Recorder::reserveBounce(size_t length) {
+  // Room for a whole frame plus one partially filled block, grown if the
+  // input format changes to larger frames
+  size_t size = roundUp(length) + RECORDER_ALIGNMENT;
+  if (size <= bounceSize_)
+    return true;
+  char* bounce = alignedAlloc(size);
+  if (bounce == NULL) {
+    setError("Failed to allocate recording buffer", 0);
+    return false;
+  }
+  if (bounce_ != NULL) {
+    memcpy(bounce, bounce_, staged_);
+    alignedFree(bounce_);
+  }
+  bounce_ = bounce;
+  bounceSize_ = size;
+  return true;
+}
+
+bool Recorder::writeFrame(IDeckLinkVideoInputFrame* frame) {
+  char* data;
+  frame->GetBytes((void**) &data);
+  size_t length = frame->GetRowBytes() * frame->GetHeight();
+
+  bool first = (bounce_ == NULL);
+  if (!reserveBounce(length))
+    return false;
+  if (first) {
+    if (!sequence_ && (maxFrames_ > 0)) {
+      // Reserve the whole recording up front to avoid fragmentation
+      #ifdef __linux__
+      posix_fallocate(file_, 0, (off_t) length * maxFrames_);
+      #else
+      truncateOutput(file_, (int64_t) length * maxFrames_);
+      #endif
+    }
+  }
+
+  if (sequence_) {
+    char name[1024];
+    snprintf(name, sizeof(name), path_.c_str(),
+      (unsigned int) framesWritten_.get());
+    bool direct = direct_;
+    uv_file file = openOutput(name, direct);
+    if (file < 0) {
+      setError("Failed to open recording file", file);
+      return false;
+    }
+    bool ok;
+    if (!direct || isAligned(data, length)) {
+      ok = writeAll(file, data, length, 0);
+    } else {
+      // Direct I/O needs whole aligned blocks - pad, then trim the file
+      size_t padded = roundUp(length);
+      memcpy(bounce_, data, length);
+      memset(bounce_ + length, 0, padded - length);
+      ok = writeAll(file, bounce_, padded, 0) && (truncateOutput(file, length) == 0);
+    }
+    closeOutput(file);
+    if (!ok) return false;
+  } else if (!direct_ || ((staged_ == 0) && isAligned(data, length))) {
+    if (!writeAll(file_, data, length, offset_)) return false;
+    offset_ += length;
+  } else {
+    // Stage through the aligned buffer, writing whole blocks and keeping
+    // any partial block for the next frame
+    while (length > 0) {
+      size_t chunk = bounceSize_ - staged_;
+      if (chunk > length) chunk = length;
+      memcpy(bounce_ + staged_, data, chunk);
+      staged_ += chunk;
+      data += chunk;
+      length -= chunk;
+      size_t whole = staged_ - (staged_ % RECORDER_ALIGNMENT);
+      if (whole > 0) {
+        if (!writeAll(file_, bounce_, whole, offset_)) return false;
+        offset_ += whole;
+        staged_ -= whole;
+        memmove(bounce_, bounce_ + whole, staged_);
+      }
+    }
+  }
+
+  framesWritten_.increment();
+  bytesWritten_.increment(frame->GetRowBytes() * frame->GetHeight());
+  return true;
+}
+
+} // namespace streampunk
@@ -0,0 +1,104 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <uv.h>
+#include <atomic>
+#include <string>
+
+#include "DeckLinkAPI.h"
+#include "RingBuffer.h"
+#include "StatCounter.h"
+
+// Maximum number of captured frames waiting for the writer thread
+#define RECORDER_QUEUE_DEPTH 16
+// Alignment of file offsets, lengths and memory for direct I/O
+#define RECORDER_ALIGNMENT 4096
+
+namespace streampunk {
+
+// Writes captured frames to disk on a dedicated thread, taking frames straight
+// from the input callback. Either writes one file per frame, with the path
+// used as a printf pattern for the frame number (e.g. "cap_%08d.v210"), or
+// appends every frame to a single file preallocated for maxFrames frames.
+// When maxFrames is not zero, recording ends after that many frames.
+// Progress and errors are signalled on the given async handle.
+class Recorder
+{
+public:
+  Recorder(const std::string& path, bool sequence, uint32_t maxFrames,
+    bool direct, uv_async_t* notify);
+  ~Recorder();
+
+  // Check that a sequence path has exactly one integer conversion for the
+  // frame number, so that it is safe to use as a printf pattern.
+  static bool validPattern(const std::string& path);
+
+  // Open the output and start the writer thread. Returns false with error()
+  // set on failure.
+  bool start();
+  // Wait for queued frames to be written, then stop the writer thread.
+  void stop();
+
+  // Input callback thread only. Takes a reference to the frame, or drops it
+  // if the writer is too far behind.
+  void push(IDeckLinkVideoInputFrame* frame);
+
+  uint64_t framesWritten() const { return framesWritten_.get(); }
+  uint64_t bytesWritten() const { return bytesWritten_.get(); }
+  uint64_t framesDropped() const { return framesDropped_.get(); }
+  // Empty unless a write has failed
+  std::string error();
+
+private:
+  static void writerThread(void* arg);
+  bool writeFrame(IDeckLinkVideoInputFrame* frame);
+  // Make the bounce buffer big enough for a frame of length bytes, keeping
+  // any staged bytes. Returns false with the error set on failure.
+  bool reserveBounce(size_t length);
+  bool writeAll(uv_file file, const char* data, size_t length, int64_t offset);
+  void setError(const char* message, int code);
+
+  std::string path_;
+  bool sequence_;
+  uint32_t maxFrames_;
+  bool direct_;
+  uv_async_t* notify_;
+
+  RingBuffer<IDeckLinkVideoInputFrame*> queue_;
+  uv_thread_t thread_;
+  uv_sem_t ready_;
+  std::atomic<bool> running_;
+  bool started_;
+  uint64_t framesAccepted_; // input callback thread only
+
+  uv_file file_;      // single file mode only
+  int64_t offset_;
+  char* bounce_;      // aligned copy for frames that cannot be written directly
+  size_t bounceSize_;
+  size_t staged_;     // bytes in bounce_ waiting for a whole block
+
+  StatCounter framesWritten_;
+  StatCounter bytesWritten_;
+  StatCounter framesDropped_;
+  uv_mutex_t padlock;
+  std::string error_;
+};
+
+} // namespace streampunk
+
+#endif
@@ -0,0 +1,79 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+namespace streampunk {
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Used to hand work from DeckLink driver callbacks to the event loop
+// without taking a lock and without losing entries when uv_async_send calls
+// are merged.
+template <typename T>
+class RingBuffer
+{
+public:
+  explicit RingBuffer(size_t capacity) :
+    size_(capacity + 1), slots_(capacity + 1), head_(0), tail_(0) {}
+
+  // Producer only. Returns false, leaving the queue unchanged, when full.
+  bool push(const T& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t next = (tail + 1) % size_;
+    if (next == head_.load(std::memory_order_acquire))
+      return false;
+    slots_[tail] = item;
+    tail_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false when empty.
+  bool pop(T& item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+    item = slots_[head];
+    head_.store((head + 1) % size_, std::memory_order_release);
+    return true;
+  }
+
+  // Snapshot of the number of queued entries; exact only on the producer or
+  // consumer thread.
+  size_t size() const {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    return (tail + size_ - head) % size_;
+  }
+
+  size_t capacity() const { return size_ - 1; }
+
+private:
+  const size_t size_;
+  std::vector<T> slots_;
+  // Keep the consumer and producer indexes on separate cache lines
+  char padHead_[64];
+  std::atomic<size_t> head_;
+  char padTail_[64];
+  std::atomic<size_t> tail_;
+};
+
+} // namespace streampunk
+
+#endif
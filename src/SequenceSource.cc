@@ -0,0 +1,257 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "SequenceSource.h"
+#include "Convert.h"
+#include "FrameGeometry.h"
+#include <fcntl.h>
+#include <string.h>
+
+namespace streampunk {
+
+SequenceSource::SequenceSource(const std::vector<std::string>& files, bool loop) :
+    files_(files), loop_(loop), pixelFormat_(bmdFormat8BitYUV),
+    fileFormat_(bmdFormat8BitYUV), running_(false), nextToRead_(0), nextToPlay_(0) {
+  uv_mutex_init(&padlock);
+  uv_cond_init(&changed);
+}
+
+SequenceSource::~SequenceSource() {
+  stop();
+  uv_cond_destroy(&changed);
+  uv_mutex_destroy(&padlock);
+}
+
+const char* SequenceSource::start(IDeckLinkOutput* output, long width, long height,
+    long rowBytes, BMDPixelFormat pixelFormat, uint32_t fileFormat,
+    uint32_t lookahead, uint32_t threads) {
+  if (files_.empty())
+    return "No files to play.";
+  pixelFormat_ = pixelFormat;
+  fileFormat_ = fileFormat;
+  for ( uint32_t x = 0 ; x < lookahead ; x++ ) {
+    SequenceSlot slot;
+    if (output->CreateVideoFrame(width, height, rowBytes, pixelFormat,
+        bmdFrameFlagDefault, &slot.frame) != S_OK) {
+      stop();
+      return "Failed to create frames to read into.";
+    }
+    slot.position = 0;
+    slot.state = SequenceSlot::Free;
+    slot.holds = 0;
+    slots_.push_back(slot);
+  }
+
+  running_ = true;
+  threads_.resize(threads);
+  for ( uint32_t x = 0 ; x < threads ; x++ ) {
+    if (uv_thread_create(&threads_[x], readerThread, this) != 0) {
+      threads_.resize(x);
+      stop();
+      return "Failed to start reading threads.";
+    }
+  }
+  return NULL;
+}
+
+void SequenceSource::stop() {
+  uv_mutex_lock(&padlock);
+  running_ = false;
+  uv_cond_broadcast(&changed);
+  uv_mutex_unlock(&padlock);
+  for ( auto& thread : threads_ )
+    uv_thread_join(&thread);
+  threads_.clear();
+
+  for ( auto& slot : slots_ )
+    slot.frame->Release();
+  slots_.clear();
+}
+
+void SequenceSource::waitReady(uint32_t count, uint32_t timeout) {
+  uint64_t deadline = uv_hrtime() + (uint64_t) timeout * 1000000;
+  uv_mutex_lock(&padlock);
+  while (true) {
+    uint32_t ready = 0;
+    for ( auto& slot : slots_ ) {
+      if ((slot.state == SequenceSlot::Ready) && (slot.position < nextToPlay_ + count))
+        ready++;
+    }
+    uint64_t now = uv_hrtime();
+    if ((ready >= count) || (ready >= slots_.size()) || (now >= deadline) ||
+        (!loop_ && (ready >= files_.size() - nextToPlay_)))
+      break;
+    uv_cond_timedwait(&changed, &padlock, deadline - now);
+  }
+  uv_mutex_unlock(&padlock);
+}
+
+IDeckLinkVideoFrame* SequenceSource::next() {
+  IDeckLinkVideoFrame* frame = NULL;
+  uv_mutex_lock(&padlock);
+  for ( auto& slot : slots_ ) {
+    if ((slot.state == SequenceSlot::Ready) && (slot.position == nextToPlay_)) {
+      slot.state = SequenceSlot::Queued;
+      slot.holds = 1;
+      nextToPlay_++;
+      frame = slot.frame;
+      break;
+    }
+  }
+  uv_mutex_unlock(&padlock);
+  return frame;
+}
+
+SequenceSlot* SequenceSource::findSlot(IDeckLinkVideoFrame* frame) {
+  for ( auto& slot : slots_ ) {
+    if (slot.frame == frame)
+      return &slot;
+  }
+  return NULL;
+}
+
+bool SequenceSource::hold(IDeckLinkVideoFrame* frame) {
+  uv_mutex_lock(&padlock);
+  SequenceSlot* slot = findSlot(frame);
+  if (slot != NULL) slot->holds++;
+  uv_mutex_unlock(&padlock);
+  return slot != NULL;
+}
+
+bool SequenceSource::drop(IDeckLinkVideoFrame* frame) {
+  uv_mutex_lock(&padlock);
+  SequenceSlot* slot = findSlot(frame);
+  if ((slot != NULL) && (slot->holds > 0) && (--slot->holds == 0)) {
+    slot->state = SequenceSlot::Free; // Ready to read ahead into
+    uv_cond_broadcast(&changed);
+  }
+  uv_mutex_unlock(&padlock);
+  return slot != NULL;
+}
+
+bool SequenceSource::ended() {
+  uv_mutex_lock(&padlock);
+  bool ended = !loop_ && (nextToPlay_ >= files_.size());
+  uv_mutex_unlock(&padlock);
+  return ended;
+}
+
+bool SequenceSource::inUse() {
+  bool inUse = false;
+  uv_mutex_lock(&padlock);
+  for ( auto& slot : slots_ ) {
+    if (slot.holds > 0) inUse = true;
+  }
+  uv_mutex_unlock(&padlock);
+  return inUse;
+}
+
+void SequenceSource::readerThread(void* arg) {
+  SequenceSource* source = static_cast<SequenceSource*>(arg);
+  std::vector<char> scratch;
+  uv_mutex_lock(&source->padlock);
+  while (source->running_) {
+    SequenceSlot* free = NULL;
+    if (source->loop_ || (source->nextToRead_ < source->files_.size())) {
+      for ( auto& slot : source->slots_ ) {
+        if (slot.state == SequenceSlot::Free) {
+          free = &slot;
+          break;
+        }
+      }
+    }
+    if (free == NULL) {
+      uv_cond_wait(&source->changed, &source->padlock);
+      continue;
+    }
+    // Claim the next position, then read without the lock so that other
+    // threads can read the positions after it at the same time
+    uint64_t position = source->nextToRead_++;
+    free->state = SequenceSlot::Reading;
+    free->position = position;
+    uv_mutex_unlock(&source->padlock);
+    source->readFrame(free, position, scratch);
+    uv_mutex_lock(&source->padlock);
+    free->state = SequenceSlot::Ready;
+    uv_cond_broadcast(&source->changed);
+  }
+  uv_mutex_unlock(&source->padlock);
+}
+
+void SequenceSource::readFrame(SequenceSlot* slot, uint64_t position,
+    std::vector<char>& scratch) {
+  const std::string& path = files_[position % files_.size()];
+  char* frameData;
+  slot->frame->GetBytes((void**) &frameData);
+  long width = slot->frame->GetWidth();
+  long height = slot->frame->GetHeight();
+  long rowBytes = slot->frame->GetRowBytes();
+  bool failed = false;
+
+  uv_fs_t req;
+  uv_file file = uv_fs_open(NULL, &req, path.c_str(), O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (file < 0) failed = true;
+  // Files may have rows padded as the card pads them or packed with no
+  // padding. Short files are read as padded, with the missing rows zeroed.
+  FrameGeometry geometry(fileFormat_, width, height);
+  long fileRowBytes = geometry.valid() ? geometry.rowBytes : rowBytes;
+  if (!failed && (uv_fs_fstat(NULL, &req, file, NULL) == 0)) {
+    long stride = geometry.strideFor((size_t) req.statbuf.st_size);
+    if (stride > 0) fileRowBytes = stride;
+  }
+  uv_fs_req_cleanup(&req);
+  // Files in another format or with other rows are read whole, then
+  // converted or copied row by row into the frame
+  bool converting = fileFormat_ != (uint32_t) pixelFormat_;
+  bool direct = !converting && (fileRowBytes == rowBytes);
+  size_t length = (size_t) fileRowBytes * height;
+  if (!direct && (scratch.size() < length))
+    scratch.resize(length);
+  char* data = direct ? frameData : scratch.data();
+  size_t done = 0;
+
+  if (file >= 0) {
+    while (done < length) {
+      uv_buf_t buf = uv_buf_init(data + done, (unsigned int) (length - done));
+      int result = uv_fs_read(NULL, &req, file, &buf, 1, done, NULL);
+      uv_fs_req_cleanup(&req);
+      if (result < 0) failed = true;
+      if (result <= 0) break; // The rest of a short file's frame is zeroed
+      done += result;
+    }
+    uv_fs_close(NULL, &req, file, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  if (done < length)
+    memset(data + done, 0, length - done);
+  if (converting) {
+    if (convertFrame(data, fileRowBytes, fileFormat_, frameData, rowBytes,
+        pixelFormat_, width, height) != NULL)
+      failed = true;
+  } else if (!direct) {
+    copyRows(data, fileRowBytes, frameData, rowBytes,
+      (fileRowBytes < rowBytes) ? fileRowBytes : rowBytes, height);
+  }
+
+  uv_mutex_lock(&padlock);
+  if (failed)
+    readErrors_.increment();
+  else
+    framesRead_.increment();
+  uv_mutex_unlock(&padlock);
+}
+
+} // namespace streampunk
@@ -0,0 +1,99 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef SEQUENCESOURCE_H
+#define SEQUENCESOURCE_H
+
+#include <uv.h>
+#include <string>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "StatCounter.h"
+
+namespace streampunk {
+
+// One frame buffer of a sequence source and the position in the sequence it
+// holds. Holds count scheduled uses, as for the playback frame ring.
+struct SequenceSlot {
+  IDeckLinkMutableVideoFrame* frame;
+  uint64_t position;
+  enum { Free, Reading, Ready, Queued } state;
+  uint32_t holds;
+};
+
+// Plays a sequence of files, one uncompressed frame per file, reading ahead
+// on a pool of threads into frames created on the output. The output callback
+// takes frames in order with next() and gives them back once played, so the
+// card's clock paces the reading.
+class SequenceSource
+{
+public:
+  SequenceSource(const std::vector<std::string>& files, bool loop);
+  ~SequenceSource();
+
+  // Create lookahead frames on the output and start the reading threads.
+  // Files in fileFormat are converted to pixelFormat after they are read.
+  // Returns an error message, or NULL on success.
+  const char* start(IDeckLinkOutput* output, long width, long height,
+    long rowBytes, BMDPixelFormat pixelFormat, uint32_t fileFormat,
+    uint32_t lookahead, uint32_t threads);
+  // Stop reading and release frames. Frames still queued on the card stay
+  // alive until the card releases them.
+  void stop();
+
+  // Wait up to timeout milliseconds for the first count frames to be read.
+  void waitReady(uint32_t count, uint32_t timeout);
+
+  // The next frame of the sequence if it has been read, or NULL. The frame
+  // has one hold for the caller.
+  IDeckLinkVideoFrame* next();
+  // Take or drop a hold on a frame. Return false if the frame is not from
+  // this source.
+  bool hold(IDeckLinkVideoFrame* frame);
+  bool drop(IDeckLinkVideoFrame* frame);
+  // True once every frame has been taken, when not looping
+  bool ended();
+  // True while any frame is still held, e.g. queued on the card
+  bool inUse();
+
+  uint64_t framesRead() const { return framesRead_.get(); }
+  uint64_t readErrors() const { return readErrors_.get(); }
+
+private:
+  static void readerThread(void* arg);
+  // Read a file into a slot's frame, using scratch for any conversion
+  void readFrame(SequenceSlot* slot, uint64_t position, std::vector<char>& scratch);
+  SequenceSlot* findSlot(IDeckLinkVideoFrame* frame);
+
+  std::vector<std::string> files_;
+  bool loop_;
+  BMDPixelFormat pixelFormat_;
+  uint32_t fileFormat_;
+  std::vector<SequenceSlot> slots_;
+  std::vector<uv_thread_t> threads_;
+  uv_mutex_t padlock;
+  uv_cond_t changed; // signalled when a slot is freed or read, or on stop
+  bool running_;
+  uint64_t nextToRead_;
+  uint64_t nextToPlay_;
+
+  StatCounter framesRead_;  // guarded by padlock, as several threads read
+  StatCounter readErrors_;
+};
+
+} // namespace streampunk
+
+#endif
@@ -0,0 +1,50 @@
+/* Copyright 2017 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef STATCOUNTER_H
+#define STATCOUNTER_H
+
+#include <atomic>
+#include <stdint.h>
+
+namespace streampunk {
+
+// Statistics counter updated by exactly one thread and read from any thread.
+// With a single writer, a relaxed load and store is enough, avoiding a locked
+// read-modify-write on the callback threads.
+class StatCounter
+{
+public:
+  StatCounter() : value_(0) {}
+
+  void increment(uint64_t by = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+  }
+
+  // Raise to value if it is a new high-water mark
+  void max(uint64_t value) {
+    if (value > value_.load(std::memory_order_relaxed))
+      value_.store(value, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value_;
+};
+
+} // namespace streampunk
+
+#endif
@@ -57,21 +57,25 @@
 
 #include "Capture.h"
 #include "Playback.h"
+#include "Convert.h"
+#include "FrameGeometry.h"
+#include "ModeCatalogue.h"
+#include "DeviceRegistry.h"
+#include "DeviceInfo.h"
+#include "DeviceStatus.h"
 
 using namespace v8;
 
 NAN_METHOD(DeckLinkVersion) {
-  IDeckLinkIterator* deckLinkIterator;
-  HRESULT	result;
-  IDeckLinkAPIInformation*	deckLinkAPIInformation;
+  IDeckLinkAPIInformation*	deckLinkAPIInformation = NULL;
   #ifdef WIN32
-  CoCreateInstance(CLSID_CDeckLinkIterator, NULL, CLSCTX_ALL, IID_IDeckLinkIterator, (void**)&deckLinkIterator);
+  CoCreateInstance(CLSID_CDeckLinkAPIInformation, NULL, CLSCTX_ALL, IID_IDeckLinkAPIInformation, (void**)&deckLinkAPIInformation);
   #else
-  deckLinkIterator = CreateDeckLinkIteratorInstance();
+  deckLinkAPIInformation = CreateDeckLinkAPIInformationInstance();
   #endif
-  result = deckLinkIterator->QueryInterface(IID_IDeckLinkAPIInformation, (void**)&deckLinkAPIInformation);
-  if (result != S_OK) {
+  if (deckLinkAPIInformation == NULL) {
     Nan::ThrowError("Error connecting to DeckLinkAPI.");
+    return;
   }
 
   char deckVer [80];
@@ -92,46 +96,378 @@ NAN_METHOD(DeckLinkVersion) {
   info.GetReturnValue().Set(Nan::New(deckVer).ToLocalChecked());
 }
 
+// Snapshot of a device, taking it if the device is present and has not
+// been looked at before. NULL if neither.
+static const streampunk::DeviceInfo* deviceInfo(streampunk::DeviceRegistry* registry,
+    uint32_t deviceIndex, bool* present) {
+  IDeckLink* deckLink = registry->acquire(deviceIndex);
+  *present = deckLink != NULL;
+  if (deckLink == NULL)
+    return streampunk::DeviceInfo::cached(deviceIndex);
+  const streampunk::DeviceInfo* info = streampunk::DeviceInfo::forDevice(deviceIndex, deckLink);
+  streampunk::ModeCatalogue::forDevice(deviceIndex, deckLink);
+  deckLink->Release();
+  return info;
+}
+
 NAN_METHOD(GetFirstDevice) {
-  IDeckLinkIterator* deckLinkIterator;
-  HRESULT	result;
-  IDeckLinkAPIInformation *deckLinkAPIInformation;
-  IDeckLink* deckLink;
-  #ifdef WIN32
-  CoCreateInstance(CLSID_CDeckLinkIterator, NULL, CLSCTX_ALL, IID_IDeckLinkIterator, (void**)&deckLinkIterator);
-  #else
-  deckLinkIterator = CreateDeckLinkIteratorInstance();
-  #endif
-  result = deckLinkIterator->QueryInterface(IID_IDeckLinkAPIInformation, (void**)&deckLinkAPIInformation);
-  if (result != S_OK) {
+  streampunk::DeviceRegistry* registry = streampunk::DeviceRegistry::get();
+  if (registry == NULL) {
     Nan::ThrowError("Error connecting to DeckLinkAPI.");
+    return;
   }
-  if (deckLinkIterator->Next(&deckLink) != S_OK) {
+  bool present;
+  const streampunk::DeviceInfo* device = deviceInfo(registry, 0, &present);
+  if (!present || (device == NULL) || device->modelName.empty()) {
     info.GetReturnValue().SetUndefined();
     return;
   }
-  #ifdef WIN32
-  BSTR deviceNameBSTR = NULL;
-  result = deckLink->GetModelName(&deviceNameBSTR);
-  if (result == S_OK) {
-    _bstr_t deviceName(deviceNameBSTR, false);
-    info.GetReturnValue().Set(Nan::New((char*) deviceName).ToLocalChecked());
+  info.GetReturnValue().Set(Nan::New(device->modelName).ToLocalChecked());
+}
+
+// Modes of a device by pixel format, from the input or output formats of
+// each mode
+static Local<Object> modesByFormat(const streampunk::ModeCatalogue* catalogue, bool input) {
+  Local<Object> result = Nan::New<Object>();
+  if (catalogue == NULL) return result;
+  for ( auto& entry : catalogue->modes() ) {
+    for ( auto format : (input ? entry.inputFormats : entry.outputFormats) ) {
+      Local<Value> key = Nan::New<Number>((double) format);
+      Local<Value> modes = Nan::Get(result, key).ToLocalChecked();
+      if (!modes->IsArray()) {
+        modes = Nan::New<Array>();
+        Nan::Set(result, key, modes);
+      }
+      Local<Array> list = modes.As<Array>();
+      Nan::Set(list, list->Length(), Nan::New<Number>((double) entry.mode));
+    }
+  }
+  return result;
+}
+
+// getDevices() - a snapshot of every device seen by the process, by index,
+// with its attributes and the modes it can capture and play in each pixel
+// format. Snapshots are taken the first time a device is asked for.
+NAN_METHOD(GetDevices) {
+  streampunk::DeviceRegistry* registry = streampunk::DeviceRegistry::get();
+  Local<Array> result = Nan::New<Array>();
+  if (registry == NULL) {
+    info.GetReturnValue().Set(result);
     return;
   }
-  #elif __APPLE__
-  CFStringRef deviceNameCFString = NULL;
-  result = deckLink->GetModelName(&deviceNameCFString);
-  if (result == S_OK) {
-    char deviceName [64];
-    CFStringGetCString(deviceNameCFString, deviceName, sizeof(deviceName), kCFStringEncodingMacRoman);
-    info.GetReturnValue().Set(Nan::New(deviceName).ToLocalChecked());
+  for ( uint32_t x = 0 ; x < registry->count() ; x++ ) {
+    bool present;
+    const streampunk::DeviceInfo* device = deviceInfo(registry, x, &present);
+    Local<Object> item = Nan::New<Object>();
+    Nan::Set(item, Nan::New("index").ToLocalChecked(), Nan::New<Number>((double) x));
+    Nan::Set(item, Nan::New("present").ToLocalChecked(), Nan::New(present));
+    if (device != NULL) {
+      Nan::Set(item, Nan::New("modelName").ToLocalChecked(),
+        Nan::New(device->modelName).ToLocalChecked());
+      Nan::Set(item, Nan::New("displayName").ToLocalChecked(),
+        Nan::New(device->displayName).ToLocalChecked());
+      Nan::Set(item, Nan::New("hasInput").ToLocalChecked(), Nan::New(device->hasInput));
+      Nan::Set(item, Nan::New("hasOutput").ToLocalChecked(), Nan::New(device->hasOutput));
+      for ( auto& flag : device->flags )
+        Nan::Set(item, Nan::New(flag.first).ToLocalChecked(), Nan::New(flag.second));
+      for ( auto& value : device->ints )
+        Nan::Set(item, Nan::New(value.first).ToLocalChecked(),
+          Nan::New<Number>((double) value.second));
+      const streampunk::ModeCatalogue* catalogue = streampunk::ModeCatalogue::device(x);
+      Nan::Set(item, Nan::New("inputModes").ToLocalChecked(), modesByFormat(catalogue, true));
+      Nan::Set(item, Nan::New("outputModes").ToLocalChecked(), modesByFormat(catalogue, false));
+    }
+    Nan::Set(result, x, item);
+  }
+  info.GetReturnValue().Set(result);
+}
+
+static Nan::Persistent<v8::Function> deviceCB;
+static uv_async_t* deviceAsync = NULL;
+static Nan::Persistent<v8::Function> statusCB;
+static uv_async_t* statusAsync = NULL; // set once status is watched
+// Devices that could not be watched, reported through the status callback
+static std::vector<std::pair<uint32_t, std::string> > statusErrors;
+
+static streampunk::DeviceStatus* watchStatus(streampunk::DeviceRegistry* registry,
+    uint32_t deviceIndex, const char** error);
+
+// Watch a device for the status callback, queueing any error for it
+static void watchForCallback(streampunk::DeviceRegistry* registry, uint32_t deviceIndex) {
+  const char* error = NULL;
+  watchStatus(registry, deviceIndex, &error);
+  if (error != NULL) {
+    statusErrors.push_back(std::make_pair(deviceIndex, std::string(error)));
+    uv_async_send(statusAsync);
+  }
+}
+
+static void DeviceCallback(uv_async_t* handle) {
+  Nan::HandleScope scope;
+  streampunk::DeviceRegistry* registry = streampunk::DeviceRegistry::get();
+  std::vector<streampunk::DeviceEvent> events = registry->takeEvents();
+  for ( auto& event : events ) {
+    if (!event.arrived) {
+      streampunk::DeviceStatus::unwatch(event.index);
+    } else if (statusAsync != NULL) {
+      watchForCallback(registry, event.index);
+    }
+  }
+  if (deviceCB.IsEmpty()) return;
+  Nan::Callback cb(Nan::New(deviceCB));
+  for ( auto& event : events ) {
+    Local<Value> argv[2] = { Nan::New(event.arrived ? "arrived" : "removed").ToLocalChecked(),
+      Nan::New<Number>((double) event.index) };
+    cb.Call(2, argv);
+  }
+}
+
+// setDeviceCallback(cb) - call cb('arrived' or 'removed', deviceIndex) as
+// devices are plugged in and removed. Does not keep the process alive.
+// Returns an error message if device changes cannot be reported.
+NAN_METHOD(SetDeviceCallback) {
+  if (!info[0]->IsFunction()) {
+    Nan::ThrowTypeError("Device callback must be a function.");
     return;
   }
-  #endif
-  info.GetReturnValue().SetUndefined();
+  streampunk::DeviceRegistry* registry = streampunk::DeviceRegistry::get();
+  if (registry == NULL) return; // No driver, so no devices to report
+  deviceCB.Reset(info[0].As<v8::Function>());
+  if (deviceAsync == NULL) {
+    deviceAsync = new uv_async_t;
+    uv_async_init(uv_default_loop(), deviceAsync, DeviceCallback);
+    uv_unref((uv_handle_t*) deviceAsync);
+    const char* error = registry->setNotify(deviceAsync);
+    if (error != NULL)
+      info.GetReturnValue().Set(Nan::New(error).ToLocalChecked());
+  }
+}
+
+static Local<Value> statusValue(bool flag, bool known, int64_t value) {
+  if (!known) return Nan::Undefined();
+  if (flag) return Nan::New(value != 0);
+  return Nan::New<Number>((double) value);
+}
+
+static void StatusCallback(uv_async_t* handle) {
+  Nan::HandleScope scope;
+  std::vector<streampunk::StatusChange> changes = streampunk::DeviceStatus::takeChanges();
+  std::vector<std::pair<uint32_t, std::string> > errors;
+  errors.swap(statusErrors);
+  if (statusCB.IsEmpty()) return;
+  Nan::Callback cb(Nan::New(statusCB));
+  for ( auto& error : errors ) {
+    Local<Value> err = Nan::Error(error.second.c_str());
+    Nan::Set(err.As<Object>(), Nan::New("deviceIndex").ToLocalChecked(),
+      Nan::New<Number>((double) error.first));
+    Local<Value> argv[1] = { err };
+    cb.Call(1, argv);
+  }
+  if (changes.empty()) return;
+  // Every change since the last signal in one call
+  Local<Array> list = Nan::New<Array>((int) changes.size());
+  for ( uint32_t x = 0 ; x < changes.size() ; x++ ) {
+    Local<Object> change = Nan::New<Object>();
+    Nan::Set(change, Nan::New("deviceIndex").ToLocalChecked(),
+      Nan::New<Number>((double) changes[x].deviceIndex));
+    Nan::Set(change, Nan::New("name").ToLocalChecked(),
+      Nan::New(changes[x].name).ToLocalChecked());
+    Nan::Set(change, Nan::New("value").ToLocalChecked(),
+      statusValue(changes[x].flag, changes[x].known, changes[x].value));
+    Nan::Set(list, x, change);
+  }
+  Local<Value> argv[2] = { Nan::Null(), list };
+  cb.Call(2, argv);
+}
+
+// Status of a device, watching it from now on. NULL if the device is not
+// present or has no status, or with error set if it cannot be watched.
+static streampunk::DeviceStatus* watchStatus(streampunk::DeviceRegistry* registry,
+    uint32_t deviceIndex, const char** error) {
+  *error = NULL;
+  IDeckLink* deckLink = registry->acquire(deviceIndex);
+  if (deckLink == NULL) return NULL;
+  streampunk::DeviceStatus* status = streampunk::DeviceStatus::watch(deviceIndex, deckLink, error);
+  deckLink->Release();
+  return status;
+}
+
+// setStatusCallback(cb) - watch the status of every device, calling cb with
+// (null, array of { deviceIndex, name, value }) for the items that have
+// changed, or with an error for a device that cannot be watched. Does not
+// keep the process alive.
+NAN_METHOD(SetStatusCallback) {
+  if (!info[0]->IsFunction()) {
+    Nan::ThrowTypeError("Status callback must be a function.");
+    return;
+  }
+  streampunk::DeviceRegistry* registry = streampunk::DeviceRegistry::get();
+  if (registry == NULL) return; // No driver, so no devices to watch
+  statusCB.Reset(info[0].As<v8::Function>());
+  if (statusAsync == NULL) {
+    statusAsync = new uv_async_t;
+    uv_async_init(uv_default_loop(), statusAsync, StatusCallback);
+    uv_unref((uv_handle_t*) statusAsync);
+    streampunk::DeviceStatus::setNotify(statusAsync);
+    for ( uint32_t x = 0 ; x < registry->count() ; x++ )
+      watchForCallback(registry, x);
+  }
+}
+
+// getStatus([deviceIndex]) - the cached status of a device, by the names of
+// the bmdDeckLinkStatus items it reports, or undefined if the device is not
+// present or has no status.
+NAN_METHOD(GetStatus) {
+  uint32_t deviceIndex = info[0]->IsNumber() ? Nan::To<uint32_t>(info[0]).FromJust() : 0;
+  streampunk::DeviceRegistry* registry = streampunk::DeviceRegistry::get();
+  const char* error = NULL;
+  streampunk::DeviceStatus* status = (registry != NULL) ?
+    watchStatus(registry, deviceIndex, &error) : NULL;
+  if (error != NULL) {
+    Nan::ThrowError(error);
+    return;
+  }
+  if (status == NULL) {
+    info.GetReturnValue().SetUndefined();
+    return;
+  }
+  Local<Object> result = Nan::New<Object>();
+  for ( auto& item : status->values() ) {
+    if (item.known)
+      Nan::Set(result, Nan::New(item.name).ToLocalChecked(),
+        statusValue(item.flag, item.known, item.value));
+  }
+  info.GetReturnValue().Set(result);
+}
+
+// convert(src, srcFormat, dst, dstFormat[, width]) - convert frames between
+// pixel formats, returning the number of bytes written to dst. With a width,
+// src holds whole rows of that width, padded as the card pads them or packed.
+// Otherwise, src is treated as one row. Pass src as dst to convert in place.
+NAN_METHOD(Convert) {
+  if (!node::Buffer::HasInstance(info[0]) || !node::Buffer::HasInstance(info[2])) {
+    Nan::ThrowTypeError("Convert requires source and destination buffers.");
+    return;
+  }
+  if (!info[1]->IsNumber() || !info[3]->IsNumber()) {
+    Nan::ThrowTypeError("Convert requires source and destination formats.");
+    return;
+  }
+  v8::Local<v8::Object> srcObj = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+  v8::Local<v8::Object> dstObj = Nan::To<v8::Object>(info[2]).ToLocalChecked();
+  uint32_t srcFormat = Nan::To<uint32_t>(info[1]).FromJust();
+  uint32_t dstFormat = Nan::To<uint32_t>(info[3]).FromJust();
+  long width = info[4]->IsNumber() ? (long) Nan::To<int64_t>(info[4]).FromJust() : 0;
+  size_t srcLength = node::Buffer::Length(srcObj);
+  size_t dstLength = node::Buffer::Length(dstObj);
+  const char* error = NULL;
+  size_t written = 0;
+
+  if (width > 0) {
+    // Source rows may be padded or packed, destination rows are padded
+    streampunk::FrameGeometry srcGeometry(srcFormat, width, 1);
+    long srcRowBytes = srcGeometry.rowBytes;
+    long dstRowBytes = streampunk::FrameGeometry(dstFormat, width, 1).rowBytes;
+    if ((srcRowBytes == 0) || (dstRowBytes == 0)) {
+      error = "Conversion between these formats is not supported.";
+    } else {
+      if (srcLength % srcRowBytes != 0) srcRowBytes = srcGeometry.packedRowBytes;
+      long height = (srcRowBytes > 0) ? (long) (srcLength / srcRowBytes) : 0;
+      written = (size_t) (dstRowBytes * height);
+      if ((height == 0) || (srcLength % srcRowBytes != 0))
+        error = "Source is not a whole number of rows.";
+      else if (dstLength < written)
+        error = "Destination buffer is too small for the converted frame.";
+      else
+        error = streampunk::convertFrame(node::Buffer::Data(srcObj), srcRowBytes,
+          srcFormat, node::Buffer::Data(dstObj), dstRowBytes, dstFormat, width, height);
+    }
+  } else {
+    written = streampunk::convertBuffer(node::Buffer::Data(srcObj), srcLength,
+      srcFormat, node::Buffer::Data(dstObj), dstLength, dstFormat, &error);
+  }
+  if (error != NULL) {
+    Nan::ThrowError(error);
+    return;
+  }
+  info.GetReturnValue().Set(Nan::New<v8::Number>((double) written));
+}
+
+// frameGeometry(format, width, height) - row and frame sizes for frames of a
+// pixel format, with rows padded as the card pads them and packed with no
+// padding. Returns undefined for an unknown format.
+NAN_METHOD(FrameGeometry) {
+  if (!info[0]->IsNumber() || !info[1]->IsNumber() || !info[2]->IsNumber()) {
+    Nan::ThrowTypeError("Frame geometry requires a pixel format, width and height.");
+    return;
+  }
+  streampunk::FrameGeometry geometry(Nan::To<uint32_t>(info[0]).FromJust(),
+    (long) Nan::To<int64_t>(info[1]).FromJust(), (long) Nan::To<int64_t>(info[2]).FromJust());
+  if (!geometry.valid()) {
+    info.GetReturnValue().SetUndefined();
+    return;
+  }
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("rowBytes").ToLocalChecked(),
+    Nan::New<Number>((double) geometry.rowBytes));
+  Nan::Set(result, Nan::New("packedRowBytes").ToLocalChecked(),
+    Nan::New<Number>((double) geometry.packedRowBytes));
+  Nan::Set(result, Nan::New("frameBytes").ToLocalChecked(),
+    Nan::New<Number>((double) geometry.frameBytes()));
+  Nan::Set(result, Nan::New("packedFrameBytes").ToLocalChecked(),
+    Nan::New<Number>((double) geometry.packedFrameBytes()));
+  info.GetReturnValue().Set(result);
 }
 
+static Local<Array> formatList(const std::vector<uint32_t>& formats) {
+  Local<Array> list = Nan::New<Array>((int) formats.size());
+  for ( uint32_t x = 0 ; x < formats.size() ; x++ )
+    Nan::Set(list, x, Nan::New<Number>((double) formats[x]));
+  return list;
+}
 
+// getDisplayModes([deviceIndex]) - the display modes of a device, read when
+// the module loaded or the device arrived, with the pixel formats each can
+// be captured and played in. Returns undefined for a device that is not
+// present.
+NAN_METHOD(GetDisplayModes) {
+  uint32_t deviceIndex = info[0]->IsNumber() ? Nan::To<uint32_t>(info[0]).FromJust() : 0;
+  const streampunk::ModeCatalogue* catalogue = streampunk::ModeCatalogue::device(deviceIndex);
+  if (catalogue == NULL) {
+    // A device that has arrived since the module loaded
+    streampunk::DeviceRegistry* registry = streampunk::DeviceRegistry::get();
+    IDeckLink* deckLink = (registry != NULL) ? registry->acquire(deviceIndex) : NULL;
+    if (deckLink != NULL) {
+      catalogue = streampunk::ModeCatalogue::forDevice(deviceIndex, deckLink);
+      deckLink->Release();
+    }
+  }
+  if (catalogue == NULL) {
+    info.GetReturnValue().SetUndefined();
+    return;
+  }
+  const std::vector<streampunk::ModeEntry>& modes = catalogue->modes();
+  Local<Array> result = Nan::New<Array>((int) modes.size());
+  for ( uint32_t x = 0 ; x < modes.size() ; x++ ) {
+    const streampunk::ModeEntry& entry = modes[x];
+    Local<Object> mode = Nan::New<Object>();
+    Nan::Set(mode, Nan::New("mode").ToLocalChecked(), Nan::New<Number>((double) entry.mode));
+    Nan::Set(mode, Nan::New("name").ToLocalChecked(), Nan::New(entry.name).ToLocalChecked());
+    Nan::Set(mode, Nan::New("width").ToLocalChecked(), Nan::New<Number>((double) entry.width));
+    Nan::Set(mode, Nan::New("height").ToLocalChecked(), Nan::New<Number>((double) entry.height));
+    Nan::Set(mode, Nan::New("frameDuration").ToLocalChecked(),
+      Nan::New<Number>((double) entry.frameDuration));
+    Nan::Set(mode, Nan::New("timeScale").ToLocalChecked(),
+      Nan::New<Number>((double) entry.timeScale));
+    Nan::Set(mode, Nan::New("fieldDominance").ToLocalChecked(),
+      Nan::New<Number>((double) entry.fieldDominance));
+    Nan::Set(mode, Nan::New("flags").ToLocalChecked(), Nan::New<Number>((double) entry.flags));
+    Nan::Set(mode, Nan::New("inputFormats").ToLocalChecked(), formatList(entry.inputFormats));
+    Nan::Set(mode, Nan::New("outputFormats").ToLocalChecked(), formatList(entry.outputFormats));
+    Nan::Set(result, x, mode);
+  }
+  info.GetReturnValue().Set(result);
+}
 
 /* static Local<Object> makeBuffer(char* data, size_t size) {
   HandleScope scope;
@@ -154,6 +490,15 @@ NAN_METHOD(GetFirstDevice) {
 NAN_MODULE_INIT(Init) {
   Nan::Export(target, "deckLinkVersion", DeckLinkVersion);
   Nan::Export(target, "getFirstDevice", GetFirstDevice);
+  Nan::Export(target, "getDevices", GetDevices);
+  Nan::Export(target, "convert", Convert);
+  Nan::Export(target, "frameGeometry", FrameGeometry);
+  Nan::Export(target, "getDisplayModes", GetDisplayModes);
+  Nan::Export(target, "setDeviceCallback", SetDeviceCallback);
+  Nan::Export(target, "setStatusCallback", SetStatusCallback);
+  Nan::Export(target, "getStatus", GetStatus);
+  Nan::Set(target, Nan::New("convertKernel").ToLocalChecked(),
+    Nan::New(streampunk::convertKernel()).ToLocalChecked());
   streampunk::Capture::Init(target);
   streampunk::Playback::Init(target);
   #ifdef WIN32
@@ -164,6 +509,7 @@ NAN_MODULE_INIT(Init) {
 		fprintf(stderr, "Initialization of COM failed - result = %08x.\n", result);
 	}
   #endif
+  streampunk::ModeCatalogue::loadAll();
 }
 
 NODE_MODULE(macadam, Init);